@@ -0,0 +1,17 @@
+; Allocation benchmark: builds short lists that die young, so most
+; bitmap words are entirely free after a collection and the run time is
+; dominated by scm_cons. The bytecode machine shows it best.
+; Run with: time ./scm754 --vm bench/cons-alloc.scm
+
+(define (build n acc)
+  (if (= n 0)
+      acc
+      (build (- n 1) (cons n acc))))
+
+(define (run k acc)
+  (if (= k 0)
+      acc
+      (run (- k 1) (+ acc (length (build 1000 '()))))))
+
+(display (run 20000 0))
+(newline)
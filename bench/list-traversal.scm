@@ -0,0 +1,22 @@
+; List traversal benchmark: builds a long list while the evaluator
+; allocates garbage in between, then walks it many times with length,
+; so the run time is dominated by how the list cells are laid out.
+; Run with: time ./scm754 bench/list-traversal.scm
+
+(define (build n acc)
+  (if (= n 0)
+      acc
+      (build (- n 1) (cons n acc))))
+
+(define (walk lst n acc)
+  (if (= n 0)
+      acc
+      (walk lst (- n 1) (+ acc (length lst)))))
+
+(define (run k acc)
+  (if (= k 0)
+      acc
+      (run (- k 1) (+ acc (walk (build 200000 '()) 500 0)))))
+
+(display (run 4 0))
+(newline)
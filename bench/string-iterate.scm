@@ -0,0 +1,19 @@
+; String iteration benchmark: reads every character of a 100 KB string
+; with string-ref, so the run time shows whether string-length and
+; string-ref are O(1) or scan the string.
+; Run with: time ./scm754 bench/string-iterate.scm
+
+(define s (make-string 100000 #\a))
+
+(define (count str i n acc)
+  (if (= i n)
+      acc
+      (count str (+ i 1) n (if (char=? (string-ref str i) #\a) (+ acc 1) acc))))
+
+(define (run k acc)
+  (if (= k 0)
+      acc
+      (run (- k 1) (+ acc (count s 0 (string-length s) 0)))))
+
+(display (run 10 0))
+(newline)
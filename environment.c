@@ -7,21 +7,42 @@ typedef struct {
 	int8_t arity;
 } scm_ops_t;
 
-/* Environment which is a list of frames,
- * whereas each frame is a list of pairs (symbol . <value|procedure>).
- * This is needed to support nested environments and rebinding of variables.
- * Example: (((a . 4) (b . proc)) ((a . 5) (b . 8)))
- *
- * Note: all symbols stored in the environment are globally unique (interned in the global symbols list).
- * This is to avoid searching by string-compare in the environment. By using
- * interned symbols we can search in the environment using numeric equality
- * instead of string comparison. Even though symbols are globally unique, each
- * symbol can have a different binding in every environment frame! */
+/* Environment which is a chain of frames, whereas each frame holds the
+ * values of a closure's parameters, followed by its internal defines, see
+ * scm_env_frame(). The body of a closure refers to them by lexical
+ * address, the depth of the frame and the index in it, see resolve() in
+ * eval.c. No names are searched at run time.
+ * The chain ends in (), the global environment: global variables live in
+ * scm_globals, indexed by the symbol, so looking one up is a single load. */
 scm_obj_t scm_interaction_environment;
 
-/* Symbol table: list of interned symbols
- * (a b c) (cons a (cons b (cons c '()))) */
-static scm_obj_t symbols;
+/* Symbols are immortal and live outside the collected heap: a symbol is
+ * the index of its name, the names are bump allocated from blocks that
+ * are only freed with the environment. A hash table finds them: open
+ * addressing with linear probing, at most half full. */
+#define SCM_SYMBOL_TABLE_MIN 1024U
+#define SCM_SYMBOL_BLOCK     (64U << 10)
+
+typedef struct {
+	const char *name;
+	uint32_t length;
+	uint32_t hash;
+} scm_name_t;
+
+typedef struct scm_name_block
+{
+	struct scm_name_block *next;
+	char data[];
+} scm_name_block_t;
+
+static scm_name_t *names;
+static uint32_t name_size;
+uint32_t scm_symbol_num;
+scm_obj_t *scm_globals; /* SCM_ERROR if unbound */
+static scm_name_block_t *blocks;
+static char *bump, *bump_end;
+static uint32_t *table; /* symbol index + 1, 0 if empty */
+static size_t table_size;
 
 static const scm_ops_t ops[] =
 {
@@ -58,7 +79,7 @@ static const scm_ops_t ops[] =
 	[SCM_OP_CDR] = { "cdr", 1 },
 	[SCM_OP_IS_CHAR] = { "char?", 1 },
 	[SCM_OP_CONS] = { "cons", 2 },
-	[SCM_OP_DISPLAY] = { "display", 1 },
+	[SCM_OP_DISPLAY] = { "display", -1 },
 	[SCM_OP_IS_EOF_OBJECT] = { "eof-object?", 1 },
 	[SCM_OP_IS_EQ] = { "eq?", 2 },
 	[SCM_OP_IS_EQV] = { "eqv?", 2 },
@@ -69,7 +90,7 @@ static const scm_ops_t ops[] =
 	[SCM_OP_LENGTH] = { "length", 1 },
 	[SCM_OP_LOAD] = { "load", 1 },
 	[SCM_OP_MODULO] = { "modulo", 2 },
-	[SCM_OP_NEWLINE] = { "newline", 0 },
+	[SCM_OP_NEWLINE] = { "newline", -1 },
 	[SCM_OP_IS_NULL] = { "null?", 1 },
 	[SCM_OP_IS_NUMBER] = { "number?", 1 },
 	[SCM_OP_NUMBER_TO_STRING] = { "number->string", 1 },
@@ -86,40 +107,128 @@ static const scm_ops_t ops[] =
 	[SCM_OP_STRING_LENGTH] = { "string-length", 1 },
 	[SCM_OP_SUBSTRING] = { "substring", -1 },
 	[SCM_OP_IS_SYMBOL] = { "symbol?", 1 },
-	[SCM_OP_WRITE] = { "write", 1 },
+	[SCM_OP_WRITE] = { "write", -1 },
 	[SCM_OP_IS_ZERO] = { "zero?", 1 },
 	[SCM_OP_APPLY] = { "apply", 2 },
 	[SCM_OP_MAX] = { "max", -1 },
+	[SCM_OP_MAKE_STRING] = { "make-string", -1 },
+	[SCM_OP_GC_STATS] = { "gc-stats", 0 },
+	[SCM_OP_RUNTIME_STATS] = { "runtime-stats", 0 },
+	[SCM_OP_STRING_APPEND] = { "string-append", -1 },
+	[SCM_OP_OPEN_OUTPUT_STRING] = { "open-output-string", 0 },
+	[SCM_OP_GET_OUTPUT_STRING] = { "get-output-string", 1 },
+	[SCM_OP_WITH_OUTPUT_TO_STRING] = { "with-output-to-string", 1 },
+	[SCM_OP_CURRENT_OUTPUT_PORT] = { "current-output-port", 0 },
+	[SCM_OP_OPEN_INPUT_STRING] = { "open-input-string", 1 },
+	[SCM_OP_OPEN_INPUT_FILE] = { "open-input-file", 1 },
+	[SCM_OP_CLOSE_PORT] = { "close-port", 1 },
+	[SCM_OP_READ] = { "read", -1 },
+	[SCM_OP_READ_CHAR] = { "read-char", -1 },
+	[SCM_OP_PEEK_CHAR] = { "peek-char", -1 },
+	[SCM_OP_IS_INPUT_PORT] = { "input-port?", 1 },
+	[SCM_OP_IS_OUTPUT_PORT] = { "output-port?", 1 },
+	[SCM_OP_OPEN_OUTPUT_FILE] = { "open-output-file", 1 },
+	[SCM_OP_FLUSH_OUTPUT_PORT] = { "flush-output-port", -1 },
 };
 
 _Static_assert((SCM_OP_PROCEDURE_LAST + 1) == sizeof(ops)/sizeof(ops[0]), "OP array and enum out of sync");
 
-static scm_obj_t intern(scm_obj_t symbol)
+/* FNV-1a */
+static uint32_t hash(const char *name, size_t n)
 {
-	scm_obj_t x, y, z, w;
-	const char *name, *name2;
+	uint32_t h = 2166136261U;
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ (uint8_t)name[i]) * 16777619U;
+	return h;
+}
 
-	x = symbols;
-	assert(scm_is_symbol(symbol));
-	z = scm_symbol_to_string(symbol);
-	name = scm_string_value(z);
-	while (scm_is_pair(x)) {
-		y = scm_car(x);
-		assert(scm_is_symbol(y));
-		w = scm_symbol_to_string(y);
-		name2 = scm_string_value(w);
-		if (strcmp(name, name2) == 0) return y;
-		x = scm_cdr(x);
+/* The entry of the symbol or the empty one where it belongs */
+static uint32_t *find(const char *name, size_t n, uint32_t h)
+{
+	for (size_t i = h & (table_size - 1); ; i = (i + 1) & (table_size - 1)) {
+		uint32_t *e = &table[i];
+		if (*e == 0) return e;
+		const scm_name_t *x = &names[*e - 1];
+		if (x->hash == h && x->length == n && memcmp(x->name, name, n) == 0) return e;
+	}
+}
+
+static void table_init(size_t size)
+{
+	free(table);
+	table = calloc(size, sizeof(uint32_t));
+	if (table == NULL) scm_fatal("out of symbol memory");
+	table_size = size;
+	for (uint32_t k = 0; k < scm_symbol_num; k++) {
+		size_t j = names[k].hash & (size - 1);
+		while (table[j] != 0) j = (j + 1) & (size - 1);
+		table[j] = k + 1;
 	}
-	symbols = scm_cons(symbol, symbols);
+}
 
-	return symbol;
+static const char *name_copy(const char *name, size_t n)
+{
+	if ((size_t)(bump_end - bump) < n + 1) {
+		size_t size = (n + 1 > SCM_SYMBOL_BLOCK) ? n + 1 : SCM_SYMBOL_BLOCK;
+		scm_name_block_t *block = malloc(sizeof(scm_name_block_t) + size);
+		if (block == NULL) scm_fatal("out of symbol memory");
+		block->next = blocks;
+		blocks = block;
+		bump = block->data;
+		bump_end = block->data + size;
+	}
+	char *copy = bump;
+	memcpy(copy, name, n);
+	copy[n] = 0;
+	bump += n + 1;
+	return copy;
+}
+
+/* The symbol named by the n characters, which are copied if it is new */
+extern scm_obj_t scm_symbol(const char *name, size_t n)
+{
+	if (n >= UINT32_MAX) return scm_error("symbol too long");
+	uint32_t h = hash(name, n);
+	uint32_t *e = find(name, n, h);
+	if (*e != 0) return SCM_SYMBOL | (*e - 1);
+
+	if (scm_symbol_num == name_size) {
+		uint32_t size = name_size ? 2 * name_size : SCM_SYMBOL_TABLE_MIN;
+		scm_name_t *grown = realloc(names, size * sizeof(scm_name_t));
+		if (grown == NULL) scm_fatal("out of symbol memory");
+		names = grown;
+		scm_obj_t *values = realloc(scm_globals, size * sizeof(scm_obj_t));
+		if (values == NULL) scm_fatal("out of symbol memory");
+		scm_globals = values;
+		name_size = size;
+	}
+	if (2 * ((size_t)scm_symbol_num + 1) > table_size) {
+		table_init(2 * table_size);
+		e = find(name, n, h);
+	}
+	names[scm_symbol_num] = (scm_name_t){ name_copy(name, n), (uint32_t)n, h };
+	scm_globals[scm_symbol_num] = SCM_ERROR;
+	*e = ++scm_symbol_num;
+	return SCM_SYMBOL | (scm_symbol_num - 1);
 }
 
 extern scm_obj_t scm_string_to_symbol(scm_obj_t string)
 {
 	if (!scm_is_string(string)) return scm_error("not a string");
-	return intern(SCM_SYMBOL | (uint32_t)string);
+	return scm_symbol(scm_string_value(string), scm_string_length(string));
+}
+
+/* symbol->string without a copy, NUL-terminated */
+extern const char *scm_symbol_name(scm_obj_t symbol)
+{
+	assert(scm_is_symbol(symbol) && (uint32_t)symbol < scm_symbol_num);
+	return names[(uint32_t)symbol].name;
+}
+
+extern size_t scm_symbol_length(scm_obj_t symbol)
+{
+	assert(scm_is_symbol(symbol) && (uint32_t)symbol < scm_symbol_num);
+	return names[(uint32_t)symbol].length;
 }
 
 extern const char *scm_procedure_string(scm_obj_t proc)
@@ -138,67 +247,102 @@ extern scm_obj_t scm_env_create(void)
 {
 	scm_gc_init();
 
-	symbols = SCM_NIL;
+	while (blocks != NULL) {
+		scm_name_block_t *next = blocks->next;
+		free(blocks);
+		blocks = next;
+	}
+	bump = bump_end = NULL;
+	scm_symbol_num = 0;
+	table_init(SCM_SYMBOL_TABLE_MIN);
 	scm_gc_push(&scm_interaction_environment);
-	scm_gc_push(&symbols);
+	scm_current_input_port = scm_open_stdin();
+	scm_gc_push(&scm_current_input_port);
+	scm_current_output_port = scm_open_stdout();
+	scm_gc_push(&scm_current_output_port);
 
 	/* pre-intern all operations (special forms and procedures) to get
 	 * stable index and O(1) lookup during eval */
 	for (size_t i = 0; i < sizeof(ops)/sizeof(ops[0]); i++)
-		(void)scm_string_to_symbol(scm_string(ops[i].name, strlen(ops[i].name)));
+		(void)scm_symbol(ops[i].name, strlen(ops[i].name));
+	for (uint32_t id = SCM_OP_PROCEDURE_FIRST; id <= SCM_OP_PROCEDURE_LAST; id++)
+		scm_globals[id] = scm_procedure(id);
 
 	/* initial environment is empty*/
-	return scm_cons(scm_nil(), scm_nil());
+	return scm_nil();
 }
 
-extern scm_obj_t scm_env_lookup(scm_obj_t env, scm_obj_t symbol)
+extern scm_obj_t scm_env_lookup(scm_obj_t symbol)
 {
-	scm_obj_t x, y;
-
 	assert(scm_is_symbol(symbol));
-	while (scm_is_pair(env)) {
-		x = scm_car(env);
-		while (scm_is_pair(x)) {
-			y = scm_car(x);
-			assert(scm_is_pair(y));
-			if (scm_car(y) == symbol) return scm_cdr(y);
-			x = scm_cdr(x);
-		}
-		env = scm_cdr(env);
-	}
-
-	/* check if its a pre-interned procedure */
-	uint32_t id = scm_procedure_id(symbol);
-	if ((id >= SCM_OP_PROCEDURE_FIRST) && (id <= SCM_OP_PROCEDURE_LAST))
-		return scm_procedure(id);
-
-	return scm_error("unbound variable %s", scm_string_value(scm_symbol_to_string(symbol)));
+	scm_obj_t value = scm_globals[(uint32_t)symbol];
+	if (scm_is_error(value)) return scm_error("unbound variable %s", scm_symbol_name(symbol));
+	return value;
 }
 
-extern void scm_env_define(scm_obj_t env, scm_obj_t symbol, scm_obj_t value)
+extern void scm_env_define(scm_obj_t symbol, scm_obj_t value)
 {
-	assert(scm_is_pair(env));
 	assert(scm_is_symbol(symbol));
-	scm_set_car(env, scm_cons(scm_cons(symbol, value), scm_car(env)));
+	/* a minor collection marks only the remembered globals */
+	scm_globals[(uint32_t)symbol] = value;
+	if (scm_is_cell(value) || scm_is_string(value)) scm_gc_remember_global((uint32_t)symbol);
 }
 
-extern scm_obj_t scm_env_extend(scm_obj_t env, scm_obj_t params, scm_obj_t args)
+/* The cell holding a local variable and whether it is its cdr */
+static size_t slot(scm_obj_t env, scm_obj_t local, bool *in_cdr)
 {
-	if (scm_is_null(params) && scm_is_null(args))
-		return env;
+	for (uint32_t depth = scm_local_depth(local); depth > 0; depth--)
+		env = cell[(uint32_t)env].cdr;
+	assert(scm_is_env(env));
+	uint32_t index = scm_local_index(local);
+	*in_cdr = index & 1;
+	return (uint32_t)env + 1 + index / 2;
+}
 
-	if (!scm_is_pair(params) || !scm_is_pair(args))
-		return scm_error("environment: params or args missing");
+extern scm_obj_t scm_env_ref(scm_obj_t env, scm_obj_t local)
+{
+	bool in_cdr;
+	size_t i = slot(env, local, &in_cdr);
+	scm_obj_t value = in_cdr ? cell[i].cdr : cell[i].car_next;
+	/* an internal define which did not run yet holds its symbol */
+	if (scm_is_error(value)) return scm_error("unbound variable %s", scm_symbol_name(SCM_SYMBOL | (uint32_t)value));
+	return value;
+}
 
-	scm_obj_t frame = scm_nil();
-	while (scm_is_pair(params) && scm_is_pair(args)) {
-		frame = scm_cons(scm_cons(scm_car(params), scm_car(args)), frame);
-		params = scm_cdr(params);
-		args   = scm_cdr(args);
-	}
+extern void scm_env_set(scm_obj_t env, scm_obj_t local, scm_obj_t value)
+{
+	bool in_cdr;
+	size_t i = slot(env, local, &in_cdr);
+	/* through the pair mutators for the write barrier, the frame may be
+	 * old */
+	if (in_cdr) scm_set_cdr(SCM_PAIR | i, value);
+	else scm_set_car(SCM_PAIR | i, value);
+}
 
-	if (!scm_is_null(params) || !scm_is_null(args))
-		return scm_error("environment: parameter/argument mismatch");
+/* A new frame for a closure, the layout is (scm_frame() . internal-defines).
+ * The frame is a block of adjacent cells: the header holds the number of
+ * slots and the parent, the others two slots each. The caller fills in the
+ * arguments. No frame is made if nothing is bound. */
+extern scm_obj_t scm_env_frame(scm_obj_t env, scm_obj_t layout)
+{
+	scm_obj_t defines = scm_cdr(layout);
+	size_t n = scm_frame_params(scm_car(layout)) + scm_frame_rest(scm_car(layout));
+	size_t slots = scm_frame_slots(scm_car(layout));
+	if (slots == 0) return env;
 
-	return scm_cons(frame, env);
+	size_t i = scm_gc_block(1 + (slots + 1) / 2);
+	cell[i].car_next = scm_number((double)slots);
+	cell[i].cdr = env;
+	for (size_t k = 0; k < slots; k++) {
+		scm_obj_t value = scm_unspecified();
+		if (k >= n) {
+			/* an internal define which did not run yet holds its symbol */
+			value = SCM_ERROR | (uint32_t)scm_car(defines);
+			defines = scm_cdr(defines);
+		}
+		if (k & 1) cell[i + 1 + k/2].cdr = value;
+		else cell[i + 1 + k/2].car_next = value;
+	}
+	if (slots & 1) cell[i + 1 + slots/2].cdr = scm_unspecified();
+	return SCM_ENV | i;
 }
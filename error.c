@@ -4,18 +4,22 @@
 extern scm_obj_t scm_error(const char *message, ...)
 {
 	va_list ap;
+	char buf[256];
 
-	fputs("; error: ", stdout);
+	scm_stdout_write("; error: ", 9);
 	va_start(ap, message);
-	vprintf(message, ap);
+	int n = vsnprintf(buf, sizeof buf, message, ap);
 	va_end(ap);
-	putchar('\n');
+	if (n > 0) scm_stdout_write(buf, (size_t)n < sizeof buf ? (size_t)n : sizeof buf - 1);
+	scm_stdout_write("\n", 1);
 
 	return SCM_ERROR;
 }
 
 extern void scm_fatal(const char *message)
 {
+	scm_flush_all();
 	puts(message);
+	fflush(stdout);
 	abort();
 }
@@ -3,16 +3,19 @@
 
 #define SCM_LAMBDA (SCM_SYMBOL | SCM_OP_LAMBDA)
 
+static scm_obj_t execute(scm_obj_t expr, scm_obj_t env);
+
 static scm_obj_t eval_list(scm_obj_t list, scm_obj_t environment_specifier)
 {
 	scm_obj_t head = scm_nil();
 	scm_obj_t tail = scm_nil();
 	scm_obj_t result;
 
-	scm_gc_push(&head);
+	scm_gc_push2(&head, &tail);
+	scm_gc_push2(&list, &environment_specifier);
 
 	while (scm_is_pair(list)) {
-		result = scm_eval(scm_car(list), environment_specifier);
+		result = execute(scm_car(list), environment_specifier);
 		if (scm_is_error(result)) goto out;
 
 		result = scm_cons(result, scm_nil());
@@ -34,63 +37,236 @@ static scm_obj_t eval_list(scm_obj_t list, scm_obj_t environment_specifier)
 		result = scm_error("eval_list: improper list");
 
 out:
-	scm_gc_pop();
+	scm_gc_pop2();
+	scm_gc_pop2();
 	return result;
 }
 
-static scm_obj_t eval_if(scm_obj_t args, scm_obj_t env)
+/* de-sugar (define (f x y) body...) -> (define f (lambda (x y) body...)) in
+ * place, so the lambda is resolved once */
+static scm_obj_t define_lambda(scm_obj_t args)
+{
+	scm_obj_t var = scm_car(args);
+	if (!scm_is_pair(var) || !scm_is_symbol(scm_car(var))) return args;
+	if (scm_is_null(scm_cdr(args))) return scm_error("define: bad form, should be (define (f x y) body...)");
+	scm_obj_t lambda = scm_cons(SCM_LAMBDA, scm_cons(scm_cdr(var), scm_cdr(args)));
+	scm_set_car(args, scm_car(var));
+	scm_set_cdr(args, scm_cons(lambda, scm_nil()));
+	return args;
+}
+
+/* Analysis: the first time a form is evaluated, it is rewritten in place
+ * into a tree of nodes, pairs headed by scm_node(), whose shape is checked
+ * once here. A reference to a local variable becomes its scm_local()
+ * address, a symbol that is left refers to a global, anything else but a
+ * pair is a constant. The nodes are
+ *   (quote . datum)
+ *   (if test then . else), else is unspecified if missing
+ *   (define var . value)
+ *   (lambda (scm_frame() . internal-defines) . body)
+ *   (and . tests), (or . tests)
+ *   (apply op . args)
+ * Let and let* are de-sugared to lambdas. The frame layout is the one
+ * scm_env_frame() makes. */
+typedef struct scm_scope {
+	scm_obj_t params;
+	scm_obj_t defines;
+	bool frame; /* false if nothing is bound, then there is no frame */
+	const struct scm_scope *up;
+} scm_scope_t;
+
+static scm_obj_t address(scm_obj_t symbol, const scm_scope_t *scope)
 {
-	scm_obj_t cond = scm_car(args);
-	args = scm_cdr(args);
+	uint32_t depth = 0;
+	for (; scope != NULL; scope = scope->up) {
+		if (!scope->frame) continue;
+		uint32_t index = 0;
+		for (scm_obj_t x = scope->params; scm_is_pair(x); x = scm_cdr(x), index++)
+			if (scm_car(x) == symbol) return scm_local(depth, index);
+		for (scm_obj_t x = scope->defines; scm_is_pair(x); x = scm_cdr(x), index++)
+			if (scm_car(x) == symbol) return scm_local(depth, index);
+		if (++depth > 0xffff) return scm_error("lambda: nested too deeply");
+	}
+	return symbol;
+}
 
-	scm_obj_t then = scm_car(args);
-	args = scm_cdr(args);
+static bool is_bound(scm_obj_t symbol, scm_obj_t params, scm_obj_t defines)
+{
+	return scm_is_pair(scm_memq(symbol, params)) || scm_is_pair(scm_memq(symbol, defines));
+}
 
-	scm_obj_t else_ = scm_nil();
-	if (!scm_is_null(args)) {
-		else_ = scm_car(args);
-		if (!scm_is_null(scm_cdr(args))) return scm_error("if: bad form, should be (if expr then [else])");
+/* Adds the variables the defines in a body bind, nested lambdas bind
+ * their own */
+static scm_obj_t scan_defines(scm_obj_t body, scm_obj_t params, scm_obj_t defines)
+{
+	for (; scm_is_pair(body); body = scm_cdr(body)) {
+		scm_obj_t x = scm_car(body);
+		if (!scm_is_pair(x)) continue;
+		scm_obj_t op = scm_car(x);
+		if (scm_is_symbol(op)) {
+			switch (scm_procedure_id(op)) {
+			case SCM_OP_QUOTE:
+			case SCM_OP_LAMBDA:
+			case SCM_OP_LET:
+			case SCM_OP_LET_STAR:
+				continue;
+			case SCM_OP_DEFINE:
+				if (!scm_is_pair(scm_cdr(x))) continue;
+				scm_obj_t var = scm_car(scm_cdr(x));
+				if (scm_is_pair(var)) var = scm_car(var);
+				else defines = scan_defines(scm_cdr(scm_cdr(x)), params, defines);
+				if (scm_is_symbol(var) && !is_bound(var, params, defines))
+					defines = scm_cons(var, defines);
+				continue;
+			default:
+				break;
+			}
+		}
+		defines = scan_defines(x, params, defines);
 	}
-	cond = scm_eval(cond, env);
-	if (scm_is_error(cond)) return cond;
+	return defines;
+}
+
+static scm_obj_t eval_let(scm_obj_t args);
+static scm_obj_t eval_let_star(scm_obj_t args);
+static scm_obj_t analyze_lambda(scm_obj_t args, const scm_scope_t *up);
 
-	return scm_boolean_value(cond) ? then
-				       : (!scm_is_null(else_) ? else_ : scm_unspecified());
+static scm_obj_t analyze(scm_obj_t expr, const scm_scope_t *scope);
+
+/* Analyzes the elements of a list in place */
+static scm_obj_t analyze_list(scm_obj_t list, const scm_scope_t *scope);
+
+static scm_obj_t make_node(scm_obj_t expr, uint32_t op, uint32_t argc, scm_obj_t operands)
+{
+	scm_set_car(expr, scm_node(op, argc));
+	scm_set_cdr(expr, operands);
+	return expr;
 }
 
-static scm_obj_t eval_define(scm_obj_t args, scm_obj_t env)
+static scm_obj_t analyze_if(scm_obj_t expr, scm_obj_t args, const scm_scope_t *scope)
+{
+	if (!scm_is_pair(args) || !scm_is_pair(scm_cdr(args))) return scm_error("if: bad form, should be (if expr then [else])");
+	scm_obj_t else_ = scm_cdr(scm_cdr(args));
+	if (!scm_is_null(else_) && (!scm_is_pair(else_) || !scm_is_null(scm_cdr(else_))))
+		return scm_error("if: bad form, should be (if expr then [else])");
+	scm_obj_t x = analyze_list(args, scope);
+	if (scm_is_error(x)) return x;
+	scm_set_cdr(scm_cdr(args), scm_is_null(else_) ? scm_unspecified() : scm_car(else_));
+	return make_node(expr, SCM_OP_IF, 0, args);
+}
+
+static scm_obj_t analyze_define(scm_obj_t expr, scm_obj_t args, const scm_scope_t *scope)
 {
-	scm_obj_t value;
+	if (!scm_is_pair(args)) return scm_error("define: bad form, should be (define var value) or (define (f x y) body)");
+	args = define_lambda(args);
+	if (scm_is_error(args)) return args;
 	scm_obj_t var = scm_car(args);
-	args = scm_cdr(args);
-	if (scm_is_symbol(var)) { /* variable define */
-		if (!scm_is_null(scm_cdr(args))) return scm_error("define: bad form, should be (define x expr)");
-		value = scm_eval(scm_car(args), env);
-		goto out;
-	}
-	else if (scm_is_pair(var) && scm_is_symbol(scm_car(var))) { /* function define - de-sugar to lambda */
-		if (scm_is_null(args)) return scm_error("define: bad form, should be (define (f x y) body...)");
-		value = scm_eval(scm_cons(SCM_LAMBDA, scm_cons(scm_cdr(var), args)), env);
-		var = scm_car(var);
-		goto out;
+	if (!scm_is_symbol(var)) return scm_error("define: bad form, should be (define var value) or (define (f x y) body)");
+	if (!scm_is_pair(scm_cdr(args)) || !scm_is_null(scm_cdr(scm_cdr(args)))) return scm_error("define: bad form, should be (define x expr)");
+	if (scope != NULL) {
+		var = address(var, scope);
+		if (scm_is_error(var)) return var;
+		if (!scm_is_local(var) || scm_local_depth(var) != 0) return scm_error("define: not allowed here");
 	}
-	else return scm_error("define: bad form, should be (define var value) or (define (f x y) body)");
-out:
+	scm_obj_t value = analyze(scm_car(scm_cdr(args)), scope);
 	if (scm_is_error(value)) return value;
-	scm_env_define(env, var, value);
-	return scm_unspecified();
+	scm_set_car(args, var);
+	scm_set_cdr(args, value);
+	return make_node(expr, SCM_OP_DEFINE, 0, args);
 }
 
-/* convert the lambda to a closure and capture the environment */
-static scm_obj_t eval_lambda(scm_obj_t args, scm_obj_t env)
+static scm_obj_t analyze(scm_obj_t expr, const scm_scope_t *scope)
 {
-	return scm_closure(scm_cons(env, args));
+	if (scm_is_symbol(expr)) return address(expr, scope);
+	if (scm_is_null(expr)) return scm_error("eval: can not eval empty list object ()");
+	if (!scm_is_pair(expr)) return expr;
+
+	scm_obj_t op = scm_car(expr), args = scm_cdr(expr), x;
+	if (scm_is_node(op)) return expr; /* done */
+	if (scm_is_symbol(op)) {
+		switch (scm_procedure_id(op)) {
+		case SCM_OP_QUOTE:
+			if (!scm_is_pair(args) || !scm_is_null(scm_cdr(args))) return scm_error("quote: bad form, should be (quote datum)");
+			return make_node(expr, SCM_OP_QUOTE, 0, scm_car(args));
+		case SCM_OP_LAMBDA:
+			x = analyze_lambda(args, scope);
+			return scm_is_error(x) ? x : make_node(expr, SCM_OP_LAMBDA, 0, args);
+		case SCM_OP_LET:
+		case SCM_OP_LET_STAR:
+			x = (scm_procedure_id(op) == SCM_OP_LET) ? eval_let(args) : eval_let_star(args);
+			if (scm_is_error(x)) return x;
+			scm_set_car(expr, scm_car(x));
+			scm_set_cdr(expr, scm_cdr(x));
+			return analyze(expr, scope);
+		case SCM_OP_DEFINE:
+			return analyze_define(expr, args, scope);
+		case SCM_OP_IF:
+			return analyze_if(expr, args, scope);
+		case SCM_OP_AND:
+		case SCM_OP_OR:
+			x = analyze_list(args, scope);
+			return scm_is_error(x) ? x : make_node(expr, scm_procedure_id(op), 0, args);
+		default:
+			break;
+		}
+	}
+
+	uint32_t argc = 0;
+	for (x = args; scm_is_pair(x); x = scm_cdr(x)) argc++;
+	if (!scm_is_null(x)) return scm_error("eval_list: improper list");
+	x = analyze_list(expr, scope);
+	if (scm_is_error(x)) return x;
+	return make_node(expr, SCM_OP_APPLY, argc, scm_cons(scm_car(expr), scm_cdr(expr)));
 }
 
-static scm_obj_t eval_quote(scm_obj_t args)
+static scm_obj_t analyze_list(scm_obj_t list, const scm_scope_t *scope)
 {
-	if (!scm_is_null(scm_cdr(args))) return scm_error("quote: bad form, should be (quote datum)");
-	return scm_car(args);
+	for (scm_obj_t x = list; scm_is_pair(x); x = scm_cdr(x)) {
+		scm_obj_t y = scm_car(x);
+		scm_obj_t z = analyze(y, scope);
+		if (scm_is_error(z)) return z;
+		if (z != y) scm_set_car(x, z);
+	}
+	return list;
+}
+
+static scm_obj_t analyze_lambda(scm_obj_t args, const scm_scope_t *up)
+{
+	if (!scm_is_pair(args)) return scm_error("lambda: bad form, should be (lambda (x y) body...)");
+	if (!scm_is_pair(scm_cdr(args))) return scm_error("lambda: bad form, body missing");
+	scm_obj_t params = scm_car(args);
+
+	size_t n = 0;
+	scm_obj_t x;
+	for (x = params; scm_is_pair(x); x = scm_cdr(x), n++)
+		if (!scm_is_symbol(scm_car(x))) return scm_error("lambda: parameters must be symbols");
+	if (!scm_is_null(x) && !scm_is_symbol(x)) return scm_error("lambda: bad parameter list");
+	bool rest = scm_is_symbol(x);
+	if (rest) { /* (x y . z) -> (x y z) */
+		scm_obj_t list = scm_nil();
+		for (x = params; scm_is_pair(x); x = scm_cdr(x))
+			list = scm_cons(scm_car(x), list);
+		params = scm_cons(x, list);
+		for (list = scm_nil(); scm_is_pair(params); params = scm_cdr(params))
+			list = scm_cons(scm_car(params), list);
+		params = list;
+	}
+
+	scm_scope_t scope = { params, scan_defines(scm_cdr(args), params, scm_nil()), false, up };
+	size_t slots = n + rest + scm_length(scope.defines);
+	if (slots > 0xffff) return scm_error("lambda: too many variables");
+	scope.frame = slots > 0;
+
+	/* the defines were gathered last to first */
+	scm_obj_t defines = scm_nil();
+	for (x = scope.defines; scm_is_pair(x); x = scm_cdr(x))
+		defines = scm_cons(scm_car(x), defines);
+	scope.defines = defines;
+
+	x = analyze_list(scm_cdr(args), &scope);
+	if (scm_is_error(x)) return x;
+	scm_set_car(args, scm_cons(scm_frame((uint32_t)n, rest, (uint32_t)slots), defines));
+	return args;
 }
 
 static bool get_let_binding(scm_obj_t first, scm_obj_t *param, scm_obj_t *value)
@@ -178,146 +354,200 @@ static scm_obj_t eval_let_star(scm_obj_t args)
 	return root;
 }
 
-static scm_obj_t eval_and(scm_obj_t args, scm_obj_t env)
+/* Executes (define var . value) */
+static scm_obj_t eval_define(scm_obj_t args, scm_obj_t env)
 {
-	if (scm_is_null(args)) return scm_true();
-
-	scm_obj_t test;
-	while (scm_is_pair(scm_cdr(args))) {
-		test = scm_eval(scm_car(args), env);
-		if (!scm_boolean_value(test)) return scm_false();
-		args = scm_cdr(args);
-	}
-
-	return scm_car(args);
+	scm_obj_t var = scm_car(args);
+	scm_gc_push(&env);
+	scm_obj_t value = execute(scm_cdr(args), env);
+	scm_gc_pop();
+	if (scm_is_error(value)) return value;
+	if (scm_is_local(var)) scm_env_set(env, var, value);
+	else scm_env_define(var, value);
+	return scm_unspecified();
 }
 
-static scm_obj_t eval_or(scm_obj_t args, scm_obj_t env)
+/* Executes the tests of (and . tests) or (or . tests) but the last. Returns
+ * the value which decided early, else the last test to run as a tail call. */
+static scm_obj_t eval_tests(scm_obj_t args, scm_obj_t env, bool is_and, bool *tail)
 {
-	if (scm_is_null(args)) return scm_false();
+	*tail = false;
+	if (scm_is_null(args)) return scm_boolean(is_and);
 
-	scm_obj_t test;
+	scm_gc_push2(&args, &env);
 	while (scm_is_pair(scm_cdr(args))) {
-		test = scm_eval(scm_car(args), env);
-		if (scm_boolean_value(test)) return test;
+		scm_obj_t test = execute(scm_car(args), env);
+		if (scm_is_error(test) || scm_boolean_value(test) != is_and) { scm_gc_pop2(); return test; }
 		args = scm_cdr(args);
 	}
-
+	scm_gc_pop2();
+	*tail = true;
 	return scm_car(args);
 }
 
 #ifdef SCM_DEBUG
 static void debug_print(bool is_closure, scm_obj_t op, scm_obj_t args)
 {
-	if (is_closure) fputs("; lambda ", stdout);
-	else fputs("; ", stdout);
+	if (is_closure) scm_stdout_write("; lambda ", 9);
+	else scm_stdout_write("; ", 2);
 	scm_write(op);
-	putchar(' ');
+	scm_stdout_write(" ", 1);
 	scm_write(args);
-	putchar('\n');
+	scm_stdout_write("\n", 1);
 }
 #endif
 
+/* Evaluates the argc arguments of a closure, (env layout . body), straight
+ * into its new frame. args and env are the caller's registered roots. */
+static scm_obj_t eval_frame(scm_obj_t closure, uint32_t argc, scm_obj_t *args, scm_obj_t *env)
+{
+	scm_obj_t layout = scm_car(scm_cdr(closure));
+	uint32_t n = scm_frame_params(scm_car(layout));
+	bool rest = scm_frame_rest(scm_car(layout));
+	if (argc < n || (!rest && argc > n)) return scm_error("environment: parameter/argument mismatch");
+
+	scm_obj_t frame = scm_env_frame(scm_car(closure), layout);
+	scm_obj_t x;
+	scm_gc_push(&frame);
+	for (uint32_t k = 0; k < n; k++) {
+		x = execute(scm_car(*args), *env);
+		if (scm_is_error(x)) goto out;
+		/* slot k is in cell k/2 after the header, the copying collector
+		 * may have moved the frame */
+		scm_obj_t slot = SCM_PAIR | ((uint32_t)frame + 1 + k/2);
+		if (k & 1) scm_set_cdr(slot, x);
+		else scm_set_car(slot, x);
+		*args = scm_cdr(*args);
+	}
+	if (rest) {
+		x = eval_list(*args, *env);
+		if (scm_is_error(x)) goto out;
+		scm_env_set(frame, scm_local(0, n), x);
+	}
+	x = frame;
+out:
+	scm_gc_pop();
+	return x;
+}
+
 static scm_obj_t apply_closure(scm_obj_t proc, scm_obj_t env)
 {
 #ifdef SCM_DEBUG
 	debug_print(true, proc, env);
 #endif
 	scm_obj_t body = scm_cdr(proc);
+	scm_gc_push2(&body, &env);
 	while (scm_is_pair(scm_cdr(body))) {
-	    scm_obj_t result = scm_eval(scm_car(body), env);
-	    if (scm_is_error(result)) return result;
+	    scm_obj_t result = execute(scm_car(body), env);
+	    if (scm_is_error(result)) { scm_gc_pop2(); return result; }
 	    body = scm_cdr(body);
 	}
+	scm_gc_pop2();
 	return scm_car(body);
 }
 
-extern scm_obj_t scm_eval(scm_obj_t expr, scm_obj_t env)
+/* Runs an analyzed form */
+static scm_obj_t execute(scm_obj_t expr, scm_obj_t env)
 {
 	scm_obj_t result;
+	bool tail;
 
 	scm_gc_push2(&expr, &env);
 
 tail_call:
+	scm_stats.evals++;
 
-	if (scm_is_null(expr)) {
-		result = scm_error("eval: can not eval empty list object ()");
+	if (scm_is_local(expr)) {
+		result = scm_env_ref(env, expr);
 	}
 	else if (scm_is_symbol(expr)) {
-		result = scm_env_lookup(env, expr);
+		result = scm_env_lookup(expr);
 	}
 	else if (!scm_is_pair(expr)) {
-		result = expr; /* self-evaluating */
+		result = expr; /* constant */
 	}
 	else {
-		scm_obj_t op = scm_car(expr);
+		scm_obj_t node = scm_car(expr);
 		scm_obj_t args = scm_cdr(expr);
-
-		/* special forms */
-		if (scm_is_symbol(op)) {
-			switch (scm_procedure_id(op)) {
-			case SCM_OP_QUOTE:
-				result = eval_quote(args);
-				goto out;
-			case SCM_OP_DEFINE:
-				result = eval_define(args, env);
-				goto out;
-			case SCM_OP_LAMBDA:
-				result = eval_lambda(args, env);
-				goto out;
-			case SCM_OP_IF:
-				expr = result = eval_if(args, env);
-				if (scm_is_unspecified(result) || scm_is_error(result)) goto out; else goto tail_call;
-			case SCM_OP_LET:
-				expr = result = eval_let(args);
-				if (scm_is_error(result)) goto out; else goto tail_call;
-			case SCM_OP_LET_STAR:
-				expr = result = eval_let_star(args);
-				if (scm_is_error(result)) goto out; else goto tail_call;
-			case SCM_OP_AND:
-				expr = result = eval_and(args, env);
-				if (scm_is_error(result)) goto out; else goto tail_call;
-			case SCM_OP_OR:
-				expr = result = eval_or(args, env);
-				if (scm_is_error(result)) goto out; else goto tail_call;
-			default: break;
+		scm_obj_t op;
+
+		switch (scm_node_op(node)) {
+		case SCM_OP_QUOTE:
+			result = args;
+			break;
+		case SCM_OP_DEFINE:
+			result = eval_define(args, env);
+			break;
+		case SCM_OP_LAMBDA:
+			/* capture the environment */
+			result = scm_closure(scm_cons(env, args));
+			break;
+		case SCM_OP_IF:
+			result = execute(scm_car(args), env);
+			if (scm_is_error(result)) break;
+			/* re-read, the collector may move cells */
+			args = scm_cdr(scm_cdr(expr));
+			expr = scm_boolean_value(result) ? scm_car(args) : scm_cdr(args);
+			goto tail_call;
+		case SCM_OP_AND:
+		case SCM_OP_OR:
+			result = eval_tests(args, env, scm_node_op(node) == SCM_OP_AND, &tail);
+			if (!tail) break;
+			expr = result;
+			goto tail_call;
+		case SCM_OP_APPLY:
+			scm_gc_collect();
+
+			op = result = execute(scm_car(scm_cdr(expr)), env);
+			if (scm_is_error(result)) break;
+			args = scm_cdr(scm_cdr(expr));
+			scm_gc_push2(&op, &args);
+
+			if (scm_is_closure(op)) {
+				op = scm_closure_value(op);
+				env = result = eval_frame(op, scm_node_argc(node), &args, &env);
+				if (scm_is_error(result)) goto out2;
+				scm_stats.applies++;
+				expr = apply_closure(scm_cdr(op), env);
+				scm_gc_pop2();
+				scm_stats.tail_calls++;
+				goto tail_call;
 			}
-		}
 
-		scm_gc_collect();
-
-		scm_gc_push2(&op, &args);
-
-		/* application */
-		op = result = scm_eval(op, env);
-		if (scm_is_error(result)) goto out2;
+			args = result = eval_list(args, env);
+			if (scm_is_error(result)) goto out2;
 
-		args = result = eval_list(args, env);
-		if (scm_is_error(result)) goto out2;
+			scm_stats.applies++;
 
-		if (scm_is_procedure(op)) {
-			result = scm_apply(op, args);
-		}
-		else if (scm_is_closure(op)) {
-			op = scm_closure_value(op);
-			scm_obj_t param_body = scm_cdr(op);
-			env = result = scm_env_extend(scm_car(op), scm_car(param_body), args);
-			if (scm_is_error(result)) goto out2;
-			expr = apply_closure(param_body, env);
+			if (scm_is_procedure(op)) {
+				result = scm_apply(op, args);
+			}
+			else {
+				result = scm_error("eval: unknown expression type");
+			}
+		out2:
 			scm_gc_pop2();
-			goto tail_call;
-		}
-		else {
+			break;
+		default:
 			result = scm_error("eval: unknown expression type");
+			break;
 		}
-	out2:
-		scm_gc_pop2();
 	}
-out:
+
 	scm_gc_pop2();
 	return result;
 }
 
+/* Analyzes a top-level form in place, then runs it, on the bytecode
+ * machine if selected */
+extern scm_obj_t scm_eval(scm_obj_t expr, scm_obj_t env)
+{
+	assert(scm_is_null(env));
+	expr = analyze(expr, NULL);
+	if (scm_is_error(expr)) return expr;
+	return scm_vm ? scm_vm_execute(expr) : execute(expr, env);
+}
+
 extern scm_obj_t scm_apply(scm_obj_t proc, scm_obj_t args)
 {
 	if (!scm_is_procedure(proc)) return scm_error("apply: attempt to apply non-procedure");
@@ -335,7 +565,7 @@ extern scm_obj_t scm_apply(scm_obj_t proc, scm_obj_t args)
 	scm_obj_t arg2 = (argc >= 2) ? scm_car(scm_cdr(args)): scm_nil();
 
 	switch (scm_procedure_id(proc)) {
-	case SCM_OP_NEWLINE: return scm_newline();
+	case SCM_OP_NEWLINE: return scm_newline_port(args);
 	case SCM_OP_CAR: return scm_car(arg1);
 	case SCM_OP_CDR: return scm_cdr(arg1);
 	case SCM_OP_IS_PROCEDURE: return scm_boolean(scm_is_procedure(arg1) || scm_is_closure(arg1));
@@ -348,12 +578,22 @@ extern scm_obj_t scm_apply(scm_obj_t proc, scm_obj_t args)
 	case SCM_OP_IS_CHAR: return scm_boolean(scm_is_char(arg1));
 	case SCM_OP_IS_NUMBER: return scm_boolean(scm_is_number(arg1));
 	case SCM_OP_LENGTH: return scm_number((double)scm_length(arg1));
-	case SCM_OP_DISPLAY: return scm_display(arg1);
-	case SCM_OP_WRITE: return scm_write(arg1);
+	case SCM_OP_DISPLAY: return scm_write_port(args, false);
+	case SCM_OP_WRITE: return scm_write_port(args, true);
 	case SCM_OP_LOAD:
-		if (!scm_is_string(arg1)) return scm_error("load: takes one string");
-		scm_obj_t tmp = scm_load(scm_string_value(arg1));
+	case SCM_OP_OPEN_INPUT_FILE:
+	case SCM_OP_OPEN_OUTPUT_FILE: {
+		char path[4096];
+		if (!scm_is_string(arg1)) return scm_error("%s: takes one string", scm_procedure_string(proc));
+		size_t n = scm_string_length(arg1);
+		if (n >= sizeof path) return scm_error("%s: file name too long", scm_procedure_string(proc));
+		memcpy(path, scm_string_value(arg1), n);
+		path[n] = 0;
+		if (scm_procedure_id(proc) == SCM_OP_OPEN_INPUT_FILE) return scm_open_input_file(path);
+		if (scm_procedure_id(proc) == SCM_OP_OPEN_OUTPUT_FILE) return scm_open_output_file(path);
+		scm_obj_t tmp = scm_load(path);
 		return scm_is_error(tmp) ? tmp : scm_unspecified();
+	}
 	case SCM_OP_IS_ZERO: return scm_is_zero(arg1);
 	case SCM_OP_STRING_LENGTH:
 		if (!scm_is_string(arg1)) return scm_error("string-length: takes one string");
@@ -396,6 +636,22 @@ extern scm_obj_t scm_apply(scm_obj_t proc, scm_obj_t args)
 	case SCM_OP_SUBSTRING: return scm_substring(args);
 	case SCM_OP_MAX: return scm_max(args);
 	case SCM_OP_APPLY: return scm_apply(arg1, arg2);
+	case SCM_OP_MAKE_STRING: return scm_make_string(args);
+	case SCM_OP_GC_STATS: return scm_gc_stats();
+	case SCM_OP_RUNTIME_STATS: return scm_runtime_stats();
+	case SCM_OP_STRING_APPEND: return scm_string_append(args);
+	case SCM_OP_OPEN_OUTPUT_STRING: return scm_open_output_string();
+	case SCM_OP_GET_OUTPUT_STRING: return scm_get_output_string(arg1);
+	case SCM_OP_WITH_OUTPUT_TO_STRING: return scm_with_output_to_string(arg1);
+	case SCM_OP_CURRENT_OUTPUT_PORT: return scm_current_output_port;
+	case SCM_OP_OPEN_INPUT_STRING: return scm_open_input_string(arg1);
+	case SCM_OP_CLOSE_PORT: return scm_close_port(arg1);
+	case SCM_OP_READ: return scm_read_port(scm_is_null(args) ? scm_current_input_port : arg1);
+	case SCM_OP_READ_CHAR: return scm_read_char(args, false);
+	case SCM_OP_PEEK_CHAR: return scm_read_char(args, true);
+	case SCM_OP_IS_INPUT_PORT: return scm_boolean(scm_is_input_port(arg1));
+	case SCM_OP_IS_OUTPUT_PORT: return scm_boolean(scm_is_output_port(arg1));
+	case SCM_OP_FLUSH_OUTPUT_PORT: return scm_flush_output_port(args);
 	default: return scm_error("apply: unknown procedure");
 	}
 }
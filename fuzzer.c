@@ -15,14 +15,13 @@ extern void scm_fatal(const char *message)
 
 int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
 {
-	FILE *mem = fmemopen((void *)data, size, "r");
-	if (!mem) return 0;
 	scm_interaction_environment = scm_env_create();
-	scm_current_input_port = mem;
+	scm_obj_t string = scm_string_copy((const char *)data, size);
+	if (scm_is_error(string)) return 0;
+	scm_current_input_port = scm_open_input_string(string);
 	scm_obj_t obj = scm_read();
 	(void) scm_eval(obj, scm_interaction_environment);
 	scm_gc_collect();
 	scm_gc_string_free();
-	fclose(mem);
 	return 0;
 }
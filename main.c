@@ -24,38 +24,81 @@ static int load_library(void)
 	}
 	return 0;
 errout:
-	puts("cant load library");
+	scm_stdout_write("cant load library\n", 18);
 	return -1;
 }
 
+/* Size in bytes with an optional k, m or g suffix, 0 on error */
+static size_t parse_size(const char *s)
+{
+	char *end;
+	unsigned long long n = strtoull(s, &end, 10);
+	if (end == s) return 0;
+	switch (*end) {
+	case 'k': case 'K': n <<= 10; end++; break;
+	case 'm': case 'M': n <<= 20; end++; break;
+	case 'g': case 'G': n <<= 30; end++; break;
+	default: break;
+	}
+	return (*end == '\0') ? (size_t)n : 0;
+}
+
+static int usage(void)
+{
+	puts("usage: scm754 [--heap=SIZE] [--heap-max=SIZE] [--heap-occupancy=PERCENT] [--gc-threads=N] [--gc-concurrent] [--gc-copy] [--vm] [--stats] [file]");
+	return 1;
+}
+
 int main(int argc, char *argv[])
 {
-	FILE *f;
 	bool repl;
+	const char *file = NULL;
+	const char *env;
+	bool stats = false;
+
+	if ((env = getenv("SCM754_HEAP")) != NULL) scm_heap_initial = parse_size(env);
+	if ((env = getenv("SCM754_HEAP_MAX")) != NULL) scm_heap_maximum = parse_size(env);
+	if ((env = getenv("SCM754_HEAP_OCCUPANCY")) != NULL) scm_heap_occupancy = (unsigned)parse_size(env);
+	if ((env = getenv("SCM754_GC_THREADS")) != NULL) scm_gc_threads = (unsigned)parse_size(env);
+	if ((env = getenv("SCM754_GC_CONCURRENT")) != NULL) scm_gc_concurrent = strcmp(env, "0") != 0;
+	if ((env = getenv("SCM754_GC_COPY")) != NULL) scm_gc_copy = strcmp(env, "0") != 0;
+	if ((env = getenv("SCM754_VM")) != NULL) scm_vm = strcmp(env, "0") != 0;
+
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (strncmp(arg, "--heap=", 7) == 0) scm_heap_initial = parse_size(arg + 7);
+		else if (strncmp(arg, "--heap-max=", 11) == 0) scm_heap_maximum = parse_size(arg + 11);
+		else if (strncmp(arg, "--heap-occupancy=", 17) == 0) scm_heap_occupancy = (unsigned)parse_size(arg + 17);
+		else if (strncmp(arg, "--gc-threads=", 13) == 0) scm_gc_threads = (unsigned)parse_size(arg + 13);
+		else if (strcmp(arg, "--gc-concurrent") == 0) scm_gc_concurrent = true;
+		else if (strcmp(arg, "--gc-copy") == 0) scm_gc_copy = true;
+		else if (strcmp(arg, "--vm") == 0) scm_vm = true;
+		else if (strcmp(arg, "--stats") == 0) stats = true;
+		else if (arg[0] == '-' || file != NULL) return usage();
+		else file = arg;
+	}
+	if (scm_heap_initial == 0 || scm_heap_maximum == 0) return usage();
+	if (scm_heap_occupancy < 10 || scm_heap_occupancy > 95) return usage();
+	if (scm_gc_threads < 1 || scm_gc_threads > 64) return usage();
+	if (scm_gc_copy && (scm_gc_concurrent || scm_gc_threads > 1)) return usage();
 
 	scm_interaction_environment = scm_env_create();
+	atexit(scm_flush_all);
 
 	if (load_library() < 0) return 1;
 
-	if (argc < 2) {
+	if (file == NULL) {
 		repl = true;
-		scm_current_input_port = stdin;
 	}
 	else {
 		repl = false;
-		const char *file = argv[1];
-		f = fopen(file, "r");
-		if (f == NULL) {
-			printf("cant open file %s\n", file);
-			return 1;
-		}
-		scm_current_input_port = f;
+		scm_current_input_port = scm_open_input_file(file);
+		if (scm_is_error(scm_current_input_port)) return 1;
 	}
 
 	while (1) {
 		if (repl) {
-			fputs("> ", stdout);
-			fflush(stdout);
+			scm_stdout_write("> ", 2);
 		}
 		scm_obj_t obj = scm_read();
 		if (scm_is_eof_object(obj)) { break; }
@@ -67,10 +110,11 @@ int main(int argc, char *argv[])
 		/* Unspecified is returned by e.g. define. Dont print it. */
 		if (!scm_is_unspecified(obj)) {
 			scm_write(obj);
-			putchar('\n');
+			scm_newline();
 		}
 	}
 
-	if (!repl) fclose(f);
+	if (!repl) (void)scm_close_port(scm_current_input_port);
+	if (stats) scm_stats_print(stderr);
 	return 0;
 }
@@ -21,3 +21,20 @@ extern scm_obj_t scm_string_to_number(const char *string, int radix)
 
 	return scm_number(value);
 }
+
+/* The characters of x as %.16g prints them into buf, which holds 32. Integers
+ * that print without an exponent are converted by hand. */
+extern size_t scm_number_format(double x, char *buf)
+{
+	if (x > -1e16 && x < 1e16 && x == (double)(long long)x && !(x == 0 && signbit(x))) {
+		char digits[20];
+		unsigned long long u = x < 0 ? (unsigned long long)-(long long)x : (unsigned long long)x;
+		size_t n = 0, k = 0;
+		do digits[n++] = (char)('0' + u % 10); while ((u /= 10) > 0);
+		if (x < 0) buf[k++] = '-';
+		while (n > 0) buf[k++] = digits[--n];
+		return k;
+	}
+	int n = snprintf(buf, 32, "%.16g", x);
+	return n > 0 ? (size_t)n : 0;
+}
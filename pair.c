@@ -1,21 +1,76 @@
 /* (c) guenter.ebermann@htl-hl.ac.at */
 #include "scm754.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
 
-scm_pair_t cell[SCM_CELL_NUM];
+scm_pair_t *cell;
 size_t cell_head;
+size_t cell_limit;
+size_t cell_free = UINT64_MAX;
 
-static uint64_t mark_bits[SCM_CELL_NUM/64];
-_Static_assert(SCM_CELL_NUM % 64 == 0, "SCM_CELL_NUM must be multiple of 64");
+size_t cell_alloc;
+bool scm_gc_requested;
+
+size_t scm_heap_initial = SCM_SEGMENT_SIZE;
+size_t scm_heap_maximum = 512U * SCM_SEGMENT_SIZE;
+unsigned scm_heap_occupancy = 75;
+unsigned scm_gc_threads = 1;
+bool scm_gc_concurrent;
+bool scm_gc_copy;
+bool scm_gc_marking;
+
+/* Allocation budget between collections: a share, in 1/16, of the cells
+ * which are free below the target occupancy, but at least SCM_GC_BUDGET_MIN
+ * cells. The share shrinks while few cells survive, keeping the young
+ * generation small and cache-warm, and grows when many do, as collecting
+ * more often would not free more. */
+#define SCM_GC_BUDGET_MIN 4096U
+#define SCM_GC_SHARE_MAX  8U
+static size_t cell_budget = SCM_GC_BUDGET_MIN;
+static size_t budget_share = SCM_GC_SHARE_MAX / 2;
+
+static size_t cell_num; /* mapped cells */
+static size_t cell_max; /* reserved cells */
+
+/* Generational collection with sticky mark bits: a set bit marks a cell
+ * which survived a collection, i.e. belongs to the old generation. A minor
+ * collection keeps the bits, so marking stops at old cells. A full
+ * collection clears the bits first. */
+uint64_t *mark_bits;
+static uint64_t *next_bits; /* marked by the concurrent marker */
+static size_t old_num; /* marked cells */
+
+/* Lazy sweeping: a collection only restarts the sweep and scm_gc_sweep()
+ * finds the next run of unmarked cells whenever scm_cons() has used up the
+ * current one. Cells allocated since are unmarked too, but lie behind the
+ * sweep cursor. */
+static size_t sweep_index;
+
+/* Remembered set: the write barrier dirties the card, one per mark_bits
+ * word, of an old cell that is mutated. */
+static uint8_t *cards;
+static uint32_t *dirty;
+static size_t dirty_num;
+
+/* Same for the globals: a symbol whose value became a cell or string is
+ * remembered, and a minor collection marks only the values of those. */
+static uint8_t *global_cards;
+static uint32_t *dirty_globals;
+static size_t global_card_num, dirty_global_num;
+_Static_assert(SCM_SEGMENT_CELLS % 64 == 0, "SCM_SEGMENT_CELLS must be multiple of 64");
 
 #define SCM_STACK_NUM  8192U
-static const scm_obj_t *stack[SCM_STACK_NUM];
+static scm_obj_t *stack[SCM_STACK_NUM];
 static size_t stack_index;
 
-extern void scm_gc_push(const scm_obj_t *obj)
+extern void scm_gc_push(scm_obj_t *obj)
 {
 	if (stack_index >= SCM_STACK_NUM) scm_fatal("out of stack memory");
 	assert(stack[stack_index] == NULL);
 	stack[stack_index++] = obj;
+	if (stack_index > scm_stats.stack_peak) scm_stats.stack_peak = stack_index;
 }
 
 extern void scm_gc_pop(void)
@@ -27,7 +82,7 @@ extern void scm_gc_pop(void)
 #endif
 }
 
-extern void scm_gc_push2(const scm_obj_t *obj1, const scm_obj_t *obj2)
+extern void scm_gc_push2(scm_obj_t *obj1, scm_obj_t *obj2)
 {
 	if ((stack_index + 1) >= SCM_STACK_NUM) scm_fatal("out of stack memory");
 	assert(stack[stack_index] == NULL);
@@ -35,6 +90,7 @@ extern void scm_gc_push2(const scm_obj_t *obj1, const scm_obj_t *obj2)
 	stack[stack_index] = obj1;
 	stack[stack_index+1] = obj2;
 	stack_index += 2;
+	if (stack_index > scm_stats.stack_peak) scm_stats.stack_peak = stack_index;
 }
 
 extern void scm_gc_pop2(void)
@@ -47,85 +103,1025 @@ extern void scm_gc_pop2(void)
 	stack_index -= 2;
 }
 
+/* Reserve address space, aligned to a segment for huge pages */
+static void *reserve(size_t size, int prot)
+{
+	char *p = mmap(NULL, size + SCM_SEGMENT_SIZE, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) scm_fatal("can not reserve cell memory");
+	size_t misalign = (uintptr_t)p % SCM_SEGMENT_SIZE;
+	return misalign ? p + (SCM_SEGMENT_SIZE - misalign) : p;
+}
+
+static bool map_fixed(void *addr, size_t size)
+{
+	return mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED;
+}
+
+extern bool scm_gc_grow(void)
+{
+	if (cell_num + SCM_SEGMENT_CELLS > cell_max) return false;
+	if (!map_fixed(&cell[cell_num], SCM_SEGMENT_SIZE)) return false;
+#ifdef MADV_HUGEPAGE
+	(void)madvise(&cell[cell_num], SCM_SEGMENT_SIZE, MADV_HUGEPAGE);
+#endif
+	if (!map_fixed(&mark_bits[cell_num/64], SCM_SEGMENT_CELLS/8)) return false;
+	if (!map_fixed(&next_bits[cell_num/64], SCM_SEGMENT_CELLS/8)) return false;
+
+	cell_num += SCM_SEGMENT_CELLS;
+	scm_stats.heap_cells = cell_num;
+	return true;
+}
+
+static void concurrent_stop(void);
+static scm_pair_t *cell_to;
+
 extern void scm_gc_init(void)
 {
+	if (scm_gc_marking) concurrent_stop();
 	scm_gc_string_init();
 
-	for (size_t i = 0; i < SCM_CELL_NUM; i++) {
-		cell[i].car_next = ((i + 1) < SCM_CELL_NUM) ? i + 1 : UINT64_MAX;
-#ifndef NDEBUG
-		cell[i].cdr = SCM_ERROR;
-#endif
+	/* sizes are fixed by the first call, later calls reuse the mapping */
+	if (cell == NULL) {
+		size_t max = scm_heap_maximum / SCM_SEGMENT_SIZE;
+		size_t initial = (scm_heap_initial + SCM_SEGMENT_SIZE - 1) / SCM_SEGMENT_SIZE;
+		if (max > (1ULL << 32) / SCM_SEGMENT_CELLS) max = (1ULL << 32) / SCM_SEGMENT_CELLS;
+		if (max < 1) max = 1;
+		if (initial < 1) initial = 1;
+		if (initial > max) initial = max;
+
+		cell_max = max * SCM_SEGMENT_CELLS;
+		cell = reserve(cell_max * sizeof(scm_pair_t), PROT_NONE);
+		mark_bits = reserve(cell_max / 8, PROT_NONE);
+		next_bits = reserve(cell_max / 8, PROT_NONE);
+		if (scm_gc_copy) cell_to = reserve(cell_max * sizeof(scm_pair_t), PROT_NONE);
+		cards = reserve(cell_max / 64, PROT_READ | PROT_WRITE);
+		dirty = reserve(cell_max / 64 * sizeof(*dirty), PROT_READ | PROT_WRITE);
+		while (cell_num < initial * SCM_SEGMENT_CELLS)
+			if (!scm_gc_grow()) scm_fatal("out of cell memory");
 	}
-	cell_head = 0;
-	memset(mark_bits, 0, sizeof(mark_bits));
+
+	cell_head = cell_limit = sweep_index = 0;
+	cell_free = UINT64_MAX;
+	old_num = 0;
+	cell_alloc = 0;
+	cell_budget = SCM_GC_BUDGET_MIN;
+	budget_share = SCM_GC_SHARE_MAX / 2;
+	scm_gc_requested = false;
+	memset(mark_bits, 0, cell_num/8);
+	memset(cards, 0, cell_num/64);
+	dirty_num = 0;
+	if (global_cards != NULL) memset(global_cards, 0, global_card_num);
+	dirty_global_num = 0;
 	memset(stack, 0, sizeof(stack));
 	stack_index = 0;
+	memset(&scm_stats, 0, sizeof(scm_stats));
+	scm_stats.heap_cells = cell_num;
+}
+
+extern void scm_gc_remember(size_t i)
+{
+	if (cards[i/64]) return;
+	cards[i/64] = 1;
+	dirty[dirty_num++] = (uint32_t)(i/64);
+}
+
+extern void scm_gc_remember_global(uint32_t k)
+{
+	if (k >= global_card_num) {
+		size_t n = global_card_num ? 2 * global_card_num : 1024;
+		while (n <= k) n *= 2;
+		uint8_t *grown = realloc(global_cards, n);
+		if (grown == NULL) scm_fatal("out of remembered set memory");
+		memset(grown + global_card_num, 0, n - global_card_num);
+		global_cards = grown;
+		uint32_t *list = realloc(dirty_globals, n * sizeof(*dirty_globals));
+		if (list == NULL) scm_fatal("out of remembered set memory");
+		dirty_globals = list;
+		global_card_num = n;
+	}
+	if (global_cards[k]) return;
+	global_cards[k] = 1;
+	dirty_globals[dirty_global_num++] = k;
+}
+
+static void forget_globals(void)
+{
+	for (size_t d = 0; d < dirty_global_num; d++)
+		global_cards[dirty_globals[d]] = 0;
+	dirty_global_num = 0;
+}
+
+/* The number of cells of a block, an environment frame or code holds its
+ * slots two per cell behind the header cell */
+static inline size_t block_cells(scm_obj_t obj)
+{
+	if (!scm_is_block(obj)) return 1;
+	return 1 + ((size_t)scm_number_value(cell[(uint32_t)obj].car_next) + 1) / 2;
 }
 
+/* Marking uses an explicit, bounded stack of grey cells. A cell that does
+ * not fit is still marked and the range of such cells is rescanned
+ * afterwards, so the C stack use is constant. */
+#define SCM_MARK_STACK_NUM 4096U
+static uint32_t mark_stack[SCM_MARK_STACK_NUM];
+static size_t mark_top;
+static size_t overflow_lo = SIZE_MAX, overflow_hi;
+
+/* Cells taken off the mark stack wait in a small FIFO after being
+ * prefetched, to hide the cache miss on their car and cdr */
+#define SCM_PREFETCH_NUM 8U
+
 static void mark(scm_obj_t obj)
 {
-tail_call:
-	if (scm_is_pair(obj) || scm_is_closure(obj)) {
+	if (scm_is_cell(obj)) {
 		size_t i = (uint32_t)obj;
-		assert(i < SCM_CELL_NUM);
+		assert(i < cell_num);
 		if (mark_bits[i/64] & (1ULL << (i%64))) return;
-		mark_bits[i/64] |= (1ULL << (i%64));
+		for (size_t end = i + block_cells(obj); i < end; i++) {
+			mark_bits[i/64] |= (1ULL << (i%64));
+			old_num++;
+			if (mark_top < SCM_MARK_STACK_NUM) {
+				mark_stack[mark_top++] = (uint32_t)i;
+			}
+			else {
+				if (i < overflow_lo) overflow_lo = i;
+				if (i > overflow_hi) overflow_hi = i;
+			}
+		}
+	}
+	else if (scm_is_string(obj)) {
+		scm_gc_string_mark(obj);
+	}
+}
+
+static void mark_drain(void)
+{
+	uint32_t fifo[SCM_PREFETCH_NUM];
+	size_t first = 0, n = 0;
+
+	while (1) {
+		while (n < SCM_PREFETCH_NUM && mark_top > 0) {
+			uint32_t i = mark_stack[--mark_top];
+			__builtin_prefetch(&cell[i]);
+			fifo[(first + n++) % SCM_PREFETCH_NUM] = i;
+		}
+		if (n == 0) break;
+
+		uint32_t i = fifo[first];
+		first = (first + 1) % SCM_PREFETCH_NUM;
+		n--;
+		mark(cell[i].cdr);
 		mark(cell[i].car_next);
-		obj = cell[i].cdr;
-		goto tail_call;
 	}
-	else if (scm_is_string(obj) || scm_is_symbol(obj)) {
+}
+
+/* Trace the marked cells in the overflow range again until no cell
+ * overflows anymore */
+static void mark_rescan(void)
+{
+	while (overflow_lo <= overflow_hi) {
+		size_t lo = overflow_lo, hi = overflow_hi;
+		overflow_lo = SIZE_MAX;
+		overflow_hi = 0;
+		for (size_t w = lo/64; w <= hi/64; w++) {
+			uint64_t marked = mark_bits[w];
+			while (marked) {
+				size_t k = w*64 + (size_t)__builtin_ctzll(marked);
+				mark(cell[k].car_next);
+				mark(cell[k].cdr);
+				marked &= (marked - 1); /* clear LSB */
+			}
+			mark_drain();
+		}
+	}
+}
+
+/* Old cells on dirty cards and the remembered globals may point to young
+ * cells */
+static void mark_cards(void)
+{
+	for (size_t d = 0; d < dirty_num; d++) {
+		size_t w = dirty[d];
+		uint64_t old = mark_bits[w];
+		cards[w] = 0;
+		while (old) {
+			size_t k = w*64 + (size_t)__builtin_ctzll(old);
+			mark(cell[k].car_next);
+			mark(cell[k].cdr);
+			old &= (old - 1); /* clear LSB */
+		}
+		mark_drain();
+	}
+	dirty_num = 0;
+	for (size_t d = 0; d < dirty_global_num; d++) {
+		mark(scm_globals[dirty_globals[d]]);
+		mark_drain();
+	}
+	forget_globals();
+}
+
+/* Parallel marking with scm_gc_threads workers, worker 0 being the
+ * collecting thread. Each worker greys its share of the roots and dirty
+ * cards into its own Chase-Lev deque and steals from the others when it
+ * runs dry. A mark bit is set with an atomic fetch-or, so exactly one
+ * worker greys each cell, and the resulting mark bits are the same as
+ * with sequential marking. */
+#define SCM_GC_THREADS_MAX 64U
+
+typedef struct {
+	int64_t top __attribute__((aligned(64)));
+	int64_t bottom __attribute__((aligned(64)));
+	uint32_t buf[SCM_MARK_STACK_NUM];
+	size_t marked;
+	size_t overflow_lo, overflow_hi;
+} scm_worker_t;
+
+static scm_worker_t workers[SCM_GC_THREADS_MAX];
+static size_t worker_num;
+static pthread_t threads[SCM_GC_THREADS_MAX];
+static pthread_barrier_t job_start, job_end;
+static void (*job)(size_t id);
+static int idle_num;
+
+static bool deque_push(scm_worker_t *w, uint32_t i)
+{
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	if (b - t >= (int64_t)SCM_MARK_STACK_NUM) return false;
+	__atomic_store_n(&w->buf[b % SCM_MARK_STACK_NUM], i, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool deque_pop(scm_worker_t *w, uint32_t *i)
+{
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&w->bottom, b, __ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_SEQ_CST);
+	if (t > b) {
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	*i = __atomic_load_n(&w->buf[b % SCM_MARK_STACK_NUM], __ATOMIC_RELAXED);
+	if (t < b) return true;
+
+	/* last entry, race against the thieves */
+	bool won = __atomic_compare_exchange_n(&w->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	return won;
+}
+
+static bool deque_steal(scm_worker_t *w, uint32_t *i)
+{
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_SEQ_CST);
+	if (t >= b) return false;
+	*i = __atomic_load_n(&w->buf[t % SCM_MARK_STACK_NUM], __ATOMIC_RELAXED);
+	return __atomic_compare_exchange_n(&w->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static bool deque_empty(scm_worker_t *w)
+{
+	return __atomic_load_n(&w->top, __ATOMIC_SEQ_CST) >= __atomic_load_n(&w->bottom, __ATOMIC_SEQ_CST);
+}
+
+static void pmark(scm_worker_t *w, scm_obj_t obj)
+{
+	if (scm_is_cell(obj)) {
+		size_t i = (uint32_t)obj;
+		uint64_t bit = 1ULL << (i%64);
+		assert(i < cell_num);
+		if (__atomic_load_n(&mark_bits[i/64], __ATOMIC_RELAXED) & bit) return;
+		if (__atomic_fetch_or(&mark_bits[i/64], bit, __ATOMIC_RELAXED) & bit) return;
+		/* the header bit won the block */
+		for (size_t end = i + block_cells(obj); i < end; i++) {
+			if (i != (uint32_t)obj) __atomic_fetch_or(&mark_bits[i/64], 1ULL << (i%64), __ATOMIC_RELAXED);
+			w->marked++;
+			if (deque_push(w, (uint32_t)i)) {
+				__builtin_prefetch(&cell[i]);
+			}
+			else {
+				if (i < w->overflow_lo) w->overflow_lo = i;
+				if (i > w->overflow_hi) w->overflow_hi = i;
+			}
+		}
+	}
+	else if (scm_is_string(obj)) {
 		scm_gc_string_mark(obj);
 	}
 }
 
-static void sweep(void)
+/* Steal from the other workers; give up once all of them are idle, which
+ * also means all deques are empty, as only active workers push */
+static bool find_work(size_t id, uint32_t *i)
 {
-	size_t head = UINT64_MAX;
-	for (size_t i = 0; i < (SCM_CELL_NUM/64); i++) {
-		uint64_t dead = ~mark_bits[i];
-		mark_bits[i] = 0;
-		if (dead == 0) continue;
+	for (size_t k = 1; k < worker_num; k++)
+		if (deque_steal(&workers[(id + k) % worker_num], i)) return true;
 
-		if (dead == UINT64_MAX) {
-			size_t k;
-			for (k = i*64; k < (i*64 + 63); k++) {
-				cell[k].car_next = k + 1;
-#ifndef NDEBUG
-				cell[k].cdr = SCM_ERROR;
-#endif
+	__atomic_fetch_add(&idle_num, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&idle_num, __ATOMIC_SEQ_CST) < (int)worker_num) {
+		for (size_t k = 1; k < worker_num; k++) {
+			scm_worker_t *v = &workers[(id + k) % worker_num];
+			if (deque_empty(v)) continue;
+			__atomic_fetch_sub(&idle_num, 1, __ATOMIC_SEQ_CST);
+			if (deque_steal(v, i)) return true;
+			__atomic_fetch_add(&idle_num, 1, __ATOMIC_SEQ_CST);
+		}
+		sched_yield();
+	}
+	return false;
+}
+
+/* The root arrays besides the registered variables: the globals, and the
+ * value stack of the bytecode machine. A minor collection leaves the
+ * globals to the remembered set. */
+#define ROOT_AREAS 2
+static bool full_mark;
+static scm_obj_t *root_area(size_t k, size_t *n, bool full)
+{
+	switch (k) {
+	case 0: *n = full ? scm_symbol_num : 0; return scm_globals;
+	default: *n = scm_vm_sp; return scm_vm_stack;
+	}
+}
+
+static void mark_job(size_t id)
+{
+	scm_worker_t *w = &workers[id];
+	uint32_t i;
+
+	for (size_t j = id; j < stack_index; j += worker_num)
+		pmark(w, *stack[j]);
+	for (size_t k = 0; k < ROOT_AREAS; k++) {
+		size_t n;
+		scm_obj_t *area = root_area(k, &n, full_mark);
+		for (size_t j = id; j < n; j += worker_num)
+			pmark(w, area[j]);
+	}
+	for (size_t d = id; d < dirty_global_num; d += worker_num)
+		pmark(w, scm_globals[dirty_globals[d]]);
+
+	for (size_t d = id; d < dirty_num; d += worker_num) {
+		size_t k = dirty[d];
+		uint64_t old = __atomic_load_n(&mark_bits[k], __ATOMIC_RELAXED);
+		cards[k] = 0;
+		while (old) {
+			size_t c = k*64 + (size_t)__builtin_ctzll(old);
+			pmark(w, cell[c].car_next);
+			pmark(w, cell[c].cdr);
+			old &= (old - 1); /* clear LSB */
+		}
+	}
+
+	while (1) {
+		while (deque_pop(w, &i)) {
+			pmark(w, cell[i].cdr);
+			pmark(w, cell[i].car_next);
+		}
+		if (!find_work(id, &i)) break;
+		pmark(w, cell[i].cdr);
+		pmark(w, cell[i].car_next);
+	}
+}
+
+static void clear_job(size_t id)
+{
+	size_t words = cell_num/64;
+	size_t from = words * id / worker_num, to = words * (id + 1) / worker_num;
+	memset(&mark_bits[from], 0, (to - from) * sizeof(*mark_bits));
+	memset(&cards[from], 0, to - from);
+}
+
+static void *worker_main(void *arg)
+{
+	size_t id = (size_t)(uintptr_t)arg;
+	while (1) {
+		pthread_barrier_wait(&job_start);
+		job(id);
+		pthread_barrier_wait(&job_end);
+	}
+	return NULL;
+}
+
+static void run_job(void (*f)(size_t id))
+{
+	job = f;
+	pthread_barrier_wait(&job_start);
+	f(0);
+	pthread_barrier_wait(&job_end);
+}
+
+static void start_workers(void)
+{
+	worker_num = (scm_gc_threads < SCM_GC_THREADS_MAX) ? scm_gc_threads : SCM_GC_THREADS_MAX;
+	if (pthread_barrier_init(&job_start, NULL, (unsigned)worker_num) != 0 ||
+	    pthread_barrier_init(&job_end, NULL, (unsigned)worker_num) != 0)
+		scm_fatal("can not start gc threads");
+	for (size_t id = 1; id < worker_num; id++)
+		if (pthread_create(&threads[id], NULL, worker_main, (void *)(uintptr_t)id) != 0)
+			scm_fatal("can not start gc threads");
+}
+
+static void parallel_mark(void)
+{
+	for (size_t id = 0; id < worker_num; id++) {
+		workers[id].top = workers[id].bottom = 0;
+		workers[id].marked = 0;
+		workers[id].overflow_lo = SIZE_MAX;
+		workers[id].overflow_hi = 0;
+	}
+	idle_num = 0;
+
+	run_job(mark_job);
+
+	for (size_t id = 0; id < worker_num; id++) {
+		old_num += workers[id].marked;
+		if (workers[id].overflow_lo < overflow_lo) overflow_lo = workers[id].overflow_lo;
+		if (workers[id].overflow_hi > overflow_hi) overflow_hi = workers[id].overflow_hi;
+	}
+	dirty_num = 0;
+	forget_globals();
+}
+
+/* Bump allocation: [cell_head, cell_limit) is the current run of unmarked
+ * cells, so consecutive conses are adjacent. A bitmap word fragmented into
+ * more than SCM_RUNS_MAX runs is threaded onto the cell_free list instead,
+ * which is cheaper than finding each of its short runs. Returns the first
+ * cell of the new run or list. */
+#define SCM_RUNS_MAX 2
+extern size_t scm_gc_sweep(void)
+{
+	size_t i = sweep_index, j;
+	uint64_t bits;
+
+	while (1) {
+		if (i == cell_num && !scm_gc_grow()) scm_fatal("out of cell memory");
+		bits = ~mark_bits[i/64] & (UINT64_MAX << (i%64));
+		if (bits) break;
+		i = (i | 63) + 1;
+	}
+	i &= ~(size_t)63;
+
+	if (__builtin_popcountll(bits & ~(bits << 1)) > SCM_RUNS_MAX) {
+		size_t head = UINT64_MAX;
+		while (bits) {
+			int k = 63 - __builtin_clzll(bits); /* highest set bit */
+			cell[i + (size_t)k].car_next = head;
+			head = i + (size_t)k;
+			bits &= ~(1ULL << k);
+		}
+		sweep_index = i + 64;
+		cell_free = cell[head].car_next;
+		return head;
+	}
+
+	i += (size_t)__builtin_ctzll(bits);
+	for (j = i; j < cell_num; j = (j | 63) + 1) {
+		bits = mark_bits[j/64] & (UINT64_MAX << (j%64));
+		if (bits) {
+			j = (j & ~(size_t)63) + (size_t)__builtin_ctzll(bits);
+			break;
+		}
+	}
+
+	cell_head = i + 1;
+	cell_limit = sweep_index = j;
+	return i;
+}
+
+/* Unlinks n adjacent cells from a free list, looking at its first 64 cells
+ * only. A list threaded by scm_gc_sweep() is in address order. */
+static size_t take_adjacent(size_t *list, size_t n)
+{
+	size_t *link = list, prev = UINT64_MAX, start = 0, len = 0;
+	for (size_t k = *list, seen = 0; k != UINT64_MAX && seen < 64; seen++) {
+		size_t next = cell[k].car_next;
+		if (len > 0 && k == start + len) {
+			len++;
+		}
+		else {
+			link = (prev == UINT64_MAX) ? list : &cell[prev].car_next;
+			start = k;
+			len = 1;
+		}
+		if (len == n) {
+			*link = next;
+			return start;
+		}
+		prev = k;
+		k = next;
+	}
+	return UINT64_MAX;
+}
+
+/* n adjacent cells, for an environment frame: from the current run, else
+ * from the free list, else from the next run or fragmented word the sweep
+ * finds. A run that is too short is left to scm_cons() on the free list. */
+extern size_t scm_gc_block(size_t n)
+{
+	size_t i;
+	if (cell_limit - cell_head >= n) {
+		i = cell_head;
+		cell_head += n;
+	}
+	else if ((i = take_adjacent(&cell_free, n)) == UINT64_MAX) {
+		while (1) {
+			/* splice the rest of the run in front, ascending as
+			 * take_adjacent() expects */
+			if (cell_head < cell_limit) {
+				for (size_t k = cell_head; k + 1 < cell_limit; k++) cell[k].car_next = k + 1;
+				cell[cell_limit - 1].car_next = cell_free;
+				cell_free = cell_head;
+				cell_head = cell_limit;
 			}
-			cell[k].car_next = head;
+			size_t list = cell_free;
+			i = scm_gc_sweep();
+			if (cell_head == i + 1) {
+				cell_head = i;
+				if (cell_limit - cell_head < n) continue;
+				cell_head += n;
+				break;
+			}
+			/* a fragmented word became a list, put it in front */
+			size_t tail = i;
+			while (cell[tail].car_next != UINT64_MAX) tail = cell[tail].car_next;
+			cell[tail].car_next = list;
+			cell_free = i;
+			if ((i = take_adjacent(&cell_free, n)) != UINT64_MAX) break;
+		}
+	}
+	cell_alloc += n;
+	if (scm_gc_marking)
+		for (size_t k = i; k < i + n; k++) scm_gc_black(k);
+	return i;
+}
+
 #ifndef NDEBUG
-			cell[k].cdr = SCM_ERROR;
+/* scm_cdr() asserts against access to free cells */
+static void poison(void)
+{
+	for (size_t i = 0; i < cell_num; i++)
+		if (!(mark_bits[i/64] & (1ULL << (i%64)))) cell[i].cdr = SCM_ERROR;
+}
 #endif
-			head = i*64;
-			continue;
+
+/* Concurrent marking: a full collection starts a cycle at a safe point,
+ * which only greys the roots, and a background thread marks into
+ * next_bits while the evaluator goes on. The write barrier logs the
+ * overwritten value (snapshot at the beginning), so everything reachable
+ * at the start gets marked, and scm_cons() allocates black. Once the
+ * marker ran dry, a safe point remarks the roots and the rest of the log
+ * and swaps the bitmaps. There are no minor collections during a cycle.
+ *
+ * The marker owns the grey stack while running; it grows instead of
+ * overflowing, as the marker must not rescan cells which the evaluator
+ * mutates. */
+#define SCM_SATB_NUM 256U
+#define SCM_SATB_HANDOFFS 8U
+
+enum { MARKER_IDLE, MARKER_RUN };
+
+static pthread_t marker;
+static pthread_mutex_t marker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t marker_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t marker_done = PTHREAD_COND_INITIALIZER;
+static int marker_state;
+static bool marker_started;
+static uint32_t *grey;
+static size_t grey_num, grey_max;
+static size_t marker_num; /* cells marked by the cycle */
+static scm_obj_t *satb_log; /* handed to the marker, under marker_lock */
+static size_t satb_log_num, satb_log_max;
+static scm_obj_t satb[SCM_SATB_NUM]; /* filled by the evaluator */
+static size_t satb_num;
+static unsigned handoffs;
+
+static void cmark(scm_obj_t obj)
+{
+	if (scm_is_cell(obj)) {
+		size_t i = (uint32_t)obj;
+		uint64_t bit = 1ULL << (i%64);
+		if (__atomic_load_n(&next_bits[i/64], __ATOMIC_RELAXED) & bit) return;
+		if (__atomic_fetch_or(&next_bits[i/64], bit, __ATOMIC_RELAXED) & bit) return;
+		for (size_t end = i + block_cells(obj); i < end; i++) {
+			if (i != (uint32_t)obj) __atomic_fetch_or(&next_bits[i/64], 1ULL << (i%64), __ATOMIC_RELAXED);
+			marker_num++;
+			if (grey_num == grey_max) {
+				grey_max = grey_max ? 2 * grey_max : SCM_MARK_STACK_NUM;
+				grey = realloc(grey, grey_max * sizeof(*grey));
+				if (grey == NULL) scm_fatal("out of mark stack memory");
+			}
+			grey[grey_num++] = (uint32_t)i;
+		}
+	}
+	else if (scm_is_string(obj)) {
+		scm_gc_string_mark_next(obj);
+	}
+}
+
+static void cmark_drain(void)
+{
+	while (grey_num > 0) {
+		uint32_t i = grey[--grey_num];
+		cmark(__atomic_load_n(&cell[i].cdr, __ATOMIC_RELAXED));
+		cmark(__atomic_load_n(&cell[i].car_next, __ATOMIC_RELAXED));
+	}
+}
+
+static void *marker_main(void *arg)
+{
+	scm_obj_t *log = NULL;
+	size_t log_max = 0;
+
+	(void)arg;
+	pthread_mutex_lock(&marker_lock);
+	while (1) {
+		while (marker_state != MARKER_RUN) pthread_cond_wait(&marker_wake, &marker_lock);
+
+		/* take the log over, the evaluator appends to the other one */
+		scm_obj_t *taken = satb_log;
+		size_t taken_max = satb_log_max;
+		size_t n = satb_log_num;
+		satb_log = log;
+		satb_log_max = log_max;
+		satb_log_num = 0;
+		log = taken;
+		log_max = taken_max;
+		pthread_mutex_unlock(&marker_lock);
+
+		for (size_t j = 0; j < n; j++) {
+			cmark(log[j]);
+			cmark_drain();
+		}
+		cmark_drain();
+
+		pthread_mutex_lock(&marker_lock);
+		if (satb_log_num == 0) {
+			__atomic_store_n(&marker_state, MARKER_IDLE, __ATOMIC_RELEASE);
+			pthread_cond_signal(&marker_done);
+		}
+	}
+	return NULL;
+}
+
+extern void scm_gc_black(size_t i)
+{
+	__atomic_fetch_or(&next_bits[i/64], 1ULL << (i%64), __ATOMIC_RELAXED);
+}
+
+/* Append the evaluator's buffer to the log, marker_lock held */
+static void hand_over(void)
+{
+	if (satb_log_num + satb_num > satb_log_max) {
+		satb_log_max = 2 * satb_log_max + SCM_SATB_NUM;
+		satb_log = realloc(satb_log, satb_log_max * sizeof(*satb_log));
+		if (satb_log == NULL) scm_fatal("out of mark log memory");
+	}
+	memcpy(&satb_log[satb_log_num], satb, satb_num * sizeof(*satb));
+	satb_log_num += satb_num;
+	satb_num = 0;
+}
+
+extern void scm_gc_log(scm_obj_t obj)
+{
+	if (!scm_is_cell(obj) && !scm_is_string(obj)) return;
+	if (satb_num == SCM_SATB_NUM) {
+		pthread_mutex_lock(&marker_lock);
+		hand_over();
+		pthread_mutex_unlock(&marker_lock);
+	}
+	satb[satb_num++] = obj;
+}
+
+/* Short pause: grey the roots and wake the marker */
+static void concurrent_start(void)
+{
+	if (!marker_started) {
+		if (pthread_create(&marker, NULL, marker_main, NULL) != 0) scm_fatal("can not start gc thread");
+		marker_started = true;
+	}
+
+	pthread_mutex_lock(&marker_lock);
+	memset(next_bits, 0, cell_num/8);
+	scm_gc_string_begin();
+	marker_num = 0;
+	for (size_t j = 0; j < stack_index; j++)
+		cmark(*stack[j]);
+	for (size_t k = 0; k < ROOT_AREAS; k++) {
+		size_t n;
+		scm_obj_t *area = root_area(k, &n, true);
+		for (size_t j = 0; j < n; j++)
+			cmark(area[j]);
+	}
+	satb_num = 0;
+	handoffs = 0;
+	cell_alloc = 0; /* counts the cells allocated black */
+	scm_gc_marking = true;
+	marker_state = MARKER_RUN;
+	pthread_cond_signal(&marker_wake);
+	pthread_mutex_unlock(&marker_lock);
+}
+
+/* Returns true with marker_lock held once the marker ran dry. Until then,
+ * a full log is handed over a few times rather than traced in the pause. */
+static bool concurrent_poll(bool wait)
+{
+	if (!wait && __atomic_load_n(&marker_state, __ATOMIC_ACQUIRE) == MARKER_RUN) return false;
+
+	pthread_mutex_lock(&marker_lock);
+	while (wait && marker_state == MARKER_RUN) pthread_cond_wait(&marker_done, &marker_lock);
+	if (marker_state == MARKER_RUN) {
+		pthread_mutex_unlock(&marker_lock);
+		return false;
+	}
+	if (!wait && satb_num > SCM_SATB_NUM / 8 && handoffs < SCM_SATB_HANDOFFS) {
+		hand_over();
+		handoffs++;
+		marker_state = MARKER_RUN;
+		pthread_cond_signal(&marker_wake);
+		pthread_mutex_unlock(&marker_lock);
+		return false;
+	}
+	return true;
+}
+
+static void concurrent_stop(void)
+{
+	(void)concurrent_poll(true);
+	scm_gc_marking = false;
+	pthread_mutex_unlock(&marker_lock);
+}
+
+/* Remark pause, the marker is idle */
+static void concurrent_finish(void)
+{
+	for (size_t j = 0; j < satb_num; j++) {
+		cmark(satb[j]);
+		cmark_drain();
+	}
+	satb_num = 0;
+	for (size_t j = 0; j < stack_index; j++) {
+		cmark(*stack[j]);
+		cmark_drain();
+	}
+	for (size_t k = 0; k < ROOT_AREAS; k++) {
+		size_t n;
+		scm_obj_t *area = root_area(k, &n, true);
+		for (size_t j = 0; j < n; j++) {
+			cmark(area[j]);
+			cmark_drain();
 		}
+	}
+	scm_gc_marking = false;
+	pthread_mutex_unlock(&marker_lock);
+
+	uint64_t *bits = mark_bits;
+	mark_bits = next_bits;
+	next_bits = bits;
+	old_num = marker_num + cell_alloc;
+	scm_stats.cells_marked += marker_num;
+	scm_stats.full_collections++;
+
+	/* no old cell points to a young one, all cells are old now */
+	for (size_t d = 0; d < dirty_num; d++)
+		cards[dirty[d]] = 0;
+	dirty_num = 0;
+	forget_globals();
+	scm_gc_string_flip();
 
-		while(dead) {
-			int j = __builtin_ctzll(dead); /* count trailing zeros */
-			size_t k = i*64 + (size_t)j;
-			cell[k].car_next = head;
 #ifndef NDEBUG
-			cell[k].cdr = SCM_ERROR;
+	poison();
 #endif
-			head = k;
-			dead &= (dead - 1); /* clear LSB */
+	cell_head = cell_limit = sweep_index = 0;
+	cell_free = UINT64_MAX;
+	scm_gc_string_compact();
+	(void)scm_gc_string_sweep(true);
+}
+
+/* Copying mode: a collection copies the live cells into the second
+ * reservation cell_to and swaps the two, Cheney style. A cell is copied
+ * together with the uncopied rest of its cdr chain, so lists come out
+ * contiguous. mark_bits flags the forwarded cells, whose car_next then
+ * holds the new index, and the roots are updated in place. */
+static size_t to_num; /* mapped cells of cell_to */
+static size_t copy_top;
+
+static scm_obj_t forward(scm_obj_t obj)
+{
+	if (scm_is_cell(obj)) {
+		size_t i = (uint32_t)obj;
+		assert(i < cell_num);
+		if (!(mark_bits[i/64] & (1ULL << (i%64))) && scm_is_block(obj)) {
+			/* a block moves whole, only its header forwards */
+			size_t n = block_cells(obj);
+			memcpy(&cell_to[copy_top], &cell[i], n * sizeof(scm_pair_t));
+			mark_bits[i/64] |= 1ULL << (i%64);
+			cell[i].car_next = copy_top;
+			copy_top += n;
 		}
+		else if (!(mark_bits[i/64] & (1ULL << (i%64)))) {
+			scm_obj_t next = obj;
+			size_t j;
+			do {
+				j = (uint32_t)next;
+				cell_to[copy_top] = cell[j];
+				mark_bits[j/64] |= 1ULL << (j%64);
+				cell[j].car_next = copy_top++;
+				next = cell_to[copy_top - 1].cdr;
+				j = (uint32_t)next;
+			} while (scm_is_pair(next) && !(mark_bits[j/64] & (1ULL << (j%64))));
+		}
+		return (obj & ~(scm_obj_t)UINT32_MAX) | cell[i].car_next;
 	}
-	cell_head = head;
+	if (scm_is_string(obj)) scm_gc_string_mark(obj);
+	return obj;
 }
 
-extern void scm_gc_collect(void)
+static void copy_collect(void)
 {
-	static int i = 0;
-	if (i++ % 3000 == 0) {
+	for (; to_num < cell_num; to_num += SCM_SEGMENT_CELLS) {
+		if (!map_fixed(&cell_to[to_num], SCM_SEGMENT_SIZE)) scm_fatal("out of cell memory");
+#ifdef MADV_HUGEPAGE
+		(void)madvise(&cell_to[to_num], SCM_SEGMENT_SIZE, MADV_HUGEPAGE);
+#endif
+	}
+
+	memset(mark_bits, 0, cell_num/8);
+	scm_gc_string_unmark();
+	forget_globals();
+	copy_top = 0;
+	for (size_t j = 0; j < stack_index; j++)
+		*stack[j] = forward(*stack[j]);
+	for (size_t k = 0; k < ROOT_AREAS; k++) {
+		size_t n;
+		scm_obj_t *area = root_area(k, &n, true);
+		for (size_t j = 0; j < n; j++)
+			area[j] = forward(area[j]);
+	}
+	for (size_t k = 0; k < copy_top; k++) {
+		cell_to[k].car_next = forward(cell_to[k].car_next);
+		cell_to[k].cdr = forward(cell_to[k].cdr);
+	}
+
+	scm_pair_t *from = cell;
+	cell = cell_to;
+	cell_to = from;
+	(void)madvise(cell_to, cell_num * sizeof(scm_pair_t), MADV_DONTNEED);
+	memset(mark_bits, 0, cell_num/8);
+	old_num = copy_top;
+	scm_stats.cells_marked += copy_top;
+	scm_stats.full_collections++;
+
+#ifndef NDEBUG
+	for (size_t k = copy_top; k < cell_num; k++)
+		cell[k].cdr = SCM_ERROR;
+#endif
+	/* the free cells form a single run, a new segment follows it */
+	cell_head = copy_top;
+	cell_limit = sweep_index = cell_num;
+	cell_free = UINT64_MAX;
+	scm_gc_string_compact();
+	(void)scm_gc_string_sweep(true);
+}
+
+/* Returns true when the string slots still run low */
+static bool collect(bool full)
+{
+	size_t before = full ? 0 : old_num;
+
+	if (scm_gc_threads > 1 && worker_num == 0) start_workers();
+
+	if (full) {
+		/* sweeping is lazy, clearing is the only pass over the whole
+		 * bitmap in the pause, the workers split it by ranges */
+		if (worker_num > 1) run_job(clear_job);
+		else {
+			memset(mark_bits, 0, cell_num/8);
+			memset(cards, 0, cell_num/64);
+		}
+		dirty_num = 0;
+		forget_globals();
+		old_num = 0;
+		scm_gc_string_unmark();
+	}
+	full_mark = full;
+
+	if (worker_num > 1) {
+		parallel_mark();
+	}
+	else {
 		for (size_t j = 0; j < stack_index; j++) {
 			mark(*stack[j]);
+			mark_drain();
+		}
+		for (size_t k = 0; k < ROOT_AREAS; k++) {
+			size_t n;
+			scm_obj_t *area = root_area(k, &n, full);
+			for (size_t j = 0; j < n; j++) {
+				mark(area[j]);
+				mark_drain();
+			}
 		}
-		sweep();
-		scm_gc_string_sweep();
+		mark_cards();
+	}
+	mark_rescan();
+	scm_stats.cells_marked += old_num - before;
+	if (full) scm_stats.full_collections++;
+
+#ifndef NDEBUG
+	poison();
+#endif
+	cell_head = cell_limit = sweep_index = 0;
+	cell_free = UINT64_MAX;
+	if (full) scm_gc_string_compact();
+	return scm_gc_string_sweep(full);
+}
+
+static size_t occupancy_limit(void)
+{
+	return cell_num / 100 * scm_heap_occupancy;
+}
+
+/* Grows the heap until the old generation fills at most three quarters
+ * of the occupancy limit, leaving the minor collections room to promote
+ * cells before the next full collection is due */
+static void grow(void)
+{
+	while (old_num > occupancy_limit() / 4 * 3 && scm_gc_grow());
+}
+
+static void set_budget(void)
+{
+	size_t room = (old_num < occupancy_limit()) ? occupancy_limit() - old_num : 0;
+	cell_budget = room / 16 * budget_share;
+	if (cell_budget < SCM_GC_BUDGET_MIN) cell_budget = SCM_GC_BUDGET_MIN;
+	cell_alloc = 0;
+	scm_gc_requested = false;
+}
+
+/* Returns false when there was nothing to do yet */
+static bool step(void)
+{
+	if (scm_gc_copy) {
+		copy_collect();
+		/* a collection costs the live cells, so allocate at least as
+		 * many in between */
+		while (2 * old_num > occupancy_limit() && scm_gc_grow());
+		cell_budget = (old_num < occupancy_limit()) ? occupancy_limit() - old_num : 0;
+		if (cell_budget < SCM_GC_BUDGET_MIN) cell_budget = SCM_GC_BUDGET_MIN;
+		cell_alloc = 0;
+		scm_gc_requested = false;
+		return true;
+	}
+	if (scm_gc_marking) {
+		/* the cycle frees nothing until it finished, so wait for the
+		 * marker once the budget is used up or the heap can not grow */
+		bool wait = scm_gc_requested || cell_alloc >= cell_budget || cell_num + SCM_SEGMENT_CELLS > cell_max;
+		if (!concurrent_poll(wait)) return false;
+		concurrent_finish();
+		grow();
+		set_budget();
+		return true;
+	}
+
+	size_t old = old_num;
+	bool strings_low = collect(false);
+
+	size_t survived = old_num - old;
+	if (survived * 10 < cell_alloc) {
+		if (budget_share > 1) budget_share--;
+	}
+	else if (survived * 4 > cell_alloc) {
+		if (budget_share < SCM_GC_SHARE_MAX) budget_share++;
+	}
+
+	if ((old_num > occupancy_limit() || strings_low) && scm_gc_concurrent) {
+		concurrent_start();
+		scm_gc_requested = false;
+		return true;
 	}
+	if (old_num > occupancy_limit() || strings_low) {
+		collect(true);
+		grow();
+	}
+	set_budget();
+	return true;
+}
+
+/* Called at safe points only, collects once the allocators asked for it */
+extern void scm_gc_collect(void)
+{
+	if (!scm_gc_marking && cell_alloc < cell_budget && !scm_gc_requested) return;
+
+	struct timespec start, end;
+	size_t allocated = cell_alloc, live = old_num + cell_alloc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!step()) return;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	scm_stats.conses += allocated;
+	scm_stats.cells_freed += live - old_num;
+	scm_stats.live_cells = old_num;
+	scm_stats_pause((uint64_t)(end.tv_sec - start.tv_sec) * 1000000000U + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec);
 }
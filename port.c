@@ -1,29 +1,360 @@
 /* (c) guenter.ebermann@htl-hl.ac.at */
 
 #include "scm754.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static int peek_buffer = EOF;
-FILE *scm_current_input_port = NULL;
+/* Ports are cells tagged SCM_PORT, the car is the kind, so the collector
+ * traces them like pairs. The cdr of an output port is the string a string
+ * port appends to, or the index of a file in sinks[]. The cdr of an input
+ * port is (source . position), the source is a string or the index of a
+ * file in files[]. */
+enum {
+	SCM_PORT_STDOUT,
+	SCM_PORT_STRING,
+	SCM_PORT_OUTPUT_FILE,
+	SCM_PORT_INPUT_STRING,
+	SCM_PORT_INPUT_FILE,
+	SCM_PORT_INPUT_STDIN,
+	SCM_PORT_CLOSED
+};
 
-extern int scm_read_char(void)
+/* A file is read whole: mapped, or copied if it can not be mapped */
+typedef struct {
+	char *data;
+	size_t length;
+	bool mapped;
+	bool open;
+} scm_file_t;
+
+static scm_file_t *files;
+static size_t file_num;
+
+/* Output to stdout and files is collected in a buffer and written when it
+ * is full, on flush-output-port, before stdin is read and at exit */
+#define SCM_SINK_SIZE 65536
+typedef struct {
+	int fd;
+	bool open;
+	size_t size;
+	char buffer[SCM_SINK_SIZE];
+} scm_sink_t;
+
+static scm_sink_t standard = { .fd = 1, .open = true };
+static scm_sink_t **sinks;
+static size_t sink_num;
+static bool sink_flush(scm_sink_t *sink);
+
+/* stdin is read line by line for the REPL */
+static char *line;
+static size_t line_size, line_capacity;
+
+scm_obj_t scm_current_input_port;
+scm_obj_t scm_current_output_port;
+
+static int port_kind(scm_obj_t port)
+{
+	return (int)scm_number_value(scm_car(scm_port_value(port)));
+}
+
+extern bool scm_is_input_port(scm_obj_t obj)
+{
+	if (!scm_is_port(obj)) return false;
+	int kind = port_kind(obj);
+	return kind == SCM_PORT_INPUT_STRING || kind == SCM_PORT_INPUT_FILE || kind == SCM_PORT_INPUT_STDIN;
+}
+
+extern bool scm_is_output_port(scm_obj_t obj)
+{
+	if (!scm_is_port(obj)) return false;
+	int kind = port_kind(obj);
+	return kind == SCM_PORT_STDOUT || kind == SCM_PORT_STRING || kind == SCM_PORT_OUTPUT_FILE;
+}
+
+static scm_obj_t input_port(int kind, scm_obj_t source)
+{
+	scm_obj_t state = scm_cons(source, scm_number(0));
+	return scm_port(scm_cons(scm_number(kind), state));
+}
+
+extern scm_obj_t scm_open_stdin(void)
+{
+	return input_port(SCM_PORT_INPUT_STDIN, scm_nil());
+}
+
+extern scm_obj_t scm_open_input_string(scm_obj_t string)
+{
+	if (!scm_is_string(string)) return scm_error("open-input-string: needs a string");
+	/* a slice, so changing the string later does not change the port */
+	string = scm_string_slice(string, 0, scm_string_length(string));
+	return input_port(SCM_PORT_INPUT_STRING, string);
+}
+
+static bool read_all(int fd, scm_file_t *file)
+{
+	size_t size = 4096;
+	file->data = malloc(size);
+	file->length = 0;
+	file->mapped = false;
+	if (file->data == NULL) return false;
+
+	while (1) {
+		if (file->length == size) {
+			char *grown = realloc(file->data, 2 * size);
+			if (grown == NULL) return false;
+			file->data = grown;
+			size *= 2;
+		}
+		ssize_t n = read(fd, file->data + file->length, size - file->length);
+		if (n < 0) return false;
+		if (n == 0) return true;
+		file->length += (size_t)n;
+	}
+}
+
+extern scm_obj_t scm_open_input_file(const char *filename)
+{
+	size_t k;
+	for (k = 0; k < file_num && files[k].open; k++);
+	if (k == file_num) {
+		scm_file_t *grown = realloc(files, (file_num + 16) * sizeof(scm_file_t));
+		if (grown == NULL) return scm_error("out of file memory");
+		files = grown;
+		for (size_t j = file_num; j < file_num + 16; j++) files[j].open = false;
+		file_num += 16;
+	}
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return scm_error("cant open file %s", filename);
+
+	scm_file_t *file = &files[k];
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		file->length = (size_t)st.st_size;
+		file->data = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+		file->mapped = file->data != MAP_FAILED;
+	}
+	else {
+		file->mapped = false;
+	}
+	if (!file->mapped && !read_all(fd, file)) {
+		free(file->data);
+		close(fd);
+		return scm_error("cant read file %s", filename);
+	}
+#ifdef MADV_SEQUENTIAL
+	if (file->mapped) (void)madvise(file->data, file->length, MADV_SEQUENTIAL);
+#endif
+	close(fd);
+	file->open = true;
+
+	return input_port(SCM_PORT_INPUT_FILE, scm_number((double)k));
+}
+
+extern scm_obj_t scm_close_port(scm_obj_t port)
+{
+	if (!scm_is_port(port)) return scm_error("close-port: needs a port");
+	bool ok = true;
+	if (port_kind(port) == SCM_PORT_INPUT_FILE) {
+		scm_file_t *file = &files[(size_t)scm_number_value(scm_car(scm_cdr(scm_port_value(port))))];
+		if (file->mapped) (void)munmap(file->data, file->length);
+		else free(file->data);
+		file->open = false;
+	}
+	if (port_kind(port) == SCM_PORT_OUTPUT_FILE) {
+		scm_sink_t *sink = sinks[(size_t)scm_number_value(scm_cdr(scm_port_value(port)))];
+		ok = sink_flush(sink);
+		ok = close(sink->fd) == 0 && ok;
+		sink->open = false;
+	}
+	if (port_kind(port) != SCM_PORT_STDOUT)
+		scm_set_car(scm_port_value(port), scm_number(SCM_PORT_CLOSED));
+	return ok ? scm_unspecified() : scm_error("close-port: cant write file");
+}
+
+/* The reader scans the characters of an input port through a view, the
+ * position goes back into the port when it is done. Nothing moves the
+ * characters while the view is in use, only eval collects. */
+extern bool scm_input_begin(scm_obj_t port, scm_view_t *view)
+{
+	if (!scm_is_input_port(port)) return false;
+	scm_obj_t state = scm_cdr(scm_port_value(port));
+	scm_obj_t source = scm_car(state);
+
+	view->port = port;
+	view->pos = (size_t)scm_number_value(scm_cdr(state));
+	switch (port_kind(port)) {
+	case SCM_PORT_INPUT_STRING:
+		view->data = scm_string_value(source);
+		view->length = scm_string_length(source);
+		break;
+	case SCM_PORT_INPUT_FILE:
+		view->data = files[(size_t)scm_number_value(source)].data;
+		view->length = files[(size_t)scm_number_value(source)].length;
+		break;
+	default:
+		view->data = line;
+		view->length = line_size;
+		break;
+	}
+	return true;
+}
+
+extern void scm_input_end(const scm_view_t *view)
+{
+	scm_set_cdr(scm_cdr(scm_port_value(view->port)), scm_number((double)view->pos));
+}
+
+/* The next line of stdin once the view is used up, false at its end */
+extern bool scm_input_refill(scm_view_t *view)
+{
+	if (port_kind(view->port) != SCM_PORT_INPUT_STDIN) return false;
+	scm_flush_all();
+	ssize_t n = getline(&line, &line_capacity, stdin);
+	line_size = (n > 0) ? (size_t)n : 0;
+	view->data = line;
+	view->pos = 0;
+	view->length = line_size;
+	return n > 0;
+}
+
+extern scm_obj_t scm_open_stdout(void)
 {
-	int c;
+	return scm_port(scm_cons(scm_number(SCM_PORT_STDOUT), scm_nil()));
+}
 
-	if (peek_buffer == EOF) {
-		c = getc(scm_current_input_port);
-	} else {
-		c = peek_buffer;
-		peek_buffer = EOF;
+extern scm_obj_t scm_open_output_string(void)
+{
+	scm_obj_t string = scm_string_buffer(64);
+	if (scm_is_error(string)) return string;
+	return scm_port(scm_cons(scm_number(SCM_PORT_STRING), string));
+}
+
+extern scm_obj_t scm_open_output_file(const char *filename)
+{
+	size_t k;
+	for (k = 0; k < sink_num && sinks[k]->open; k++);
+	if (k == sink_num) {
+		scm_sink_t **grown = realloc(sinks, (sink_num + 1) * sizeof(scm_sink_t *));
+		if (grown == NULL) return scm_error("out of file memory");
+		sinks = grown;
+		if ((sinks[k] = malloc(sizeof(scm_sink_t))) == NULL) return scm_error("out of file memory");
+		sinks[k]->open = false;
+		sink_num++;
 	}
 
-	return c;
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) return scm_error("cant open file %s", filename);
+	sinks[k]->fd = fd;
+	sinks[k]->size = 0;
+	sinks[k]->open = true;
+
+	return scm_port(scm_cons(scm_number(SCM_PORT_OUTPUT_FILE), scm_number((double)k)));
 }
 
-extern int scm_peek_char(void)
+static bool sink_flush(scm_sink_t *sink)
 {
-	if (peek_buffer == EOF) {
-		peek_buffer = getc(scm_current_input_port);
+	size_t done = 0;
+	while (done < sink->size) {
+		ssize_t n = write(sink->fd, sink->buffer + done, sink->size - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		done += (size_t)n;
 	}
+	bool ok = done == sink->size;
+	sink->size = 0;
+	return ok;
+}
+
+static bool sink_write(scm_sink_t *sink, const char *chars, size_t n)
+{
+	if (sink->size + n <= SCM_SINK_SIZE) {
+		memcpy(sink->buffer + sink->size, chars, n);
+		sink->size += n;
+		return true;
+	}
+	if (!sink_flush(sink)) return false;
+	if (n < SCM_SINK_SIZE) return sink_write(sink, chars, n);
+	/* too big for the buffer, write it through */
+	while (n > 0) {
+		ssize_t k = write(sink->fd, chars, n);
+		if (k < 0 && errno == EINTR) continue;
+		if (k <= 0) return false;
+		chars += k;
+		n -= (size_t)k;
+	}
+	return true;
+}
+
+static scm_sink_t *port_sink(scm_obj_t port)
+{
+	switch (port_kind(port)) {
+	case SCM_PORT_STDOUT: return &standard;
+	case SCM_PORT_OUTPUT_FILE: return sinks[(size_t)scm_number_value(scm_cdr(scm_port_value(port)))];
+	default: return NULL;
+	}
+}
+
+extern scm_obj_t scm_port_write(scm_obj_t port, const char *chars, size_t n)
+{
+	if (port_kind(port) == SCM_PORT_STRING)
+		return scm_string_append_chars(scm_cdr(scm_port_value(port)), chars, n);
+	scm_sink_t *sink = port_sink(port);
+	if (sink == NULL) return scm_error("write: port is closed");
+	if (!sink_write(sink, chars, n)) return scm_error("write: cant write file");
+	return scm_unspecified();
+}
+
+/* Error messages and the prompt go to stdout, even while the current output
+ * port is redirected */
+extern void scm_stdout_write(const char *chars, size_t n)
+{
+	(void)sink_write(&standard, chars, n);
+}
+
+/* (flush-output-port [port]) */
+extern scm_obj_t scm_flush_output_port(scm_obj_t args)
+{
+	scm_obj_t port = scm_is_null(args) ? scm_current_output_port : scm_car(args);
+	if (!scm_is_output_port(port)) return scm_error("flush-output-port: needs an output port");
+	scm_sink_t *sink = port_sink(port);
+	if (sink != NULL && !sink_flush(sink)) return scm_error("flush-output-port: cant write file");
+	return scm_unspecified();
+}
+
+extern void scm_flush_all(void)
+{
+	(void)sink_flush(&standard);
+	for (size_t k = 0; k < sink_num; k++)
+		if (sinks[k]->open) (void)sink_flush(sinks[k]);
+}
+
+/* The characters so far, shared until either is changed */
+extern scm_obj_t scm_get_output_string(scm_obj_t port)
+{
+	if (!scm_is_port(port) || port_kind(port) != SCM_PORT_STRING)
+		return scm_error("get-output-string: needs a string port");
+	scm_obj_t string = scm_cdr(scm_port_value(port));
+	return scm_string_slice(string, 0, scm_string_length(string));
+}
+
+extern scm_obj_t scm_with_output_to_string(scm_obj_t thunk)
+{
+	if (!scm_is_procedure(thunk) && !scm_is_closure(thunk))
+		return scm_error("with-output-to-string: needs a procedure");
+
+	scm_obj_t saved = scm_current_output_port;
+	scm_obj_t port = scm_open_output_string();
+	if (scm_is_error(port)) return port;
+
+	scm_gc_push2(&saved, &port);
+	scm_current_output_port = port;
+	scm_obj_t result = scm_eval(scm_cons(thunk, scm_nil()), scm_interaction_environment);
+	scm_current_output_port = saved;
+	scm_gc_pop2();
 
-	return peek_buffer;
+	return scm_is_error(result) ? result : scm_get_output_string(port);
 }
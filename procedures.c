@@ -126,7 +126,6 @@ extern scm_obj_t scm_substring(scm_obj_t args)
 {
 	scm_obj_t a = scm_car(args);
 	if (!scm_is_string(a)) return scm_error("string-copy: needs a string");
-	const char *x = scm_string_value(a);
 
 	size_t start = 0;
 	size_t max = scm_string_length(a);
@@ -156,7 +155,7 @@ extern scm_obj_t scm_substring(scm_obj_t args)
 
 	if (start > end || end > max) return scm_error("string-copy: invalid arguements");
 
-	return scm_string(x + start, end - start);
+	return scm_string_slice(a, start, end - start);
 }
 
 extern scm_obj_t scm_string_ref(scm_obj_t string, scm_obj_t k)
@@ -178,7 +177,7 @@ extern scm_obj_t scm_string_set(scm_obj_t string, scm_obj_t k, scm_obj_t c)
 {
 	if (!scm_is_string(string) || !scm_is_number(k) || !scm_is_char(c)) return scm_error("string-set!: type err");
 
-	char *s = scm_string_value(string);
+	char *s = scm_string_mutable(string);
 	size_t len = scm_string_length(string);
 	size_t i = scm_number_to_size(k);
 	if (i == SIZE_MAX) return scm_error("string-set!: can't convert to size_t");
@@ -200,10 +199,8 @@ extern scm_obj_t scm_is_zero(scm_obj_t z)
 extern scm_obj_t scm_number_to_string(scm_obj_t number)
 {
 	if (!scm_is_number(number)) return scm_error("number->string: needs a number");
-	char buffer[64];
-	int ret = snprintf(buffer, sizeof(buffer), "%.16g", scm_number_value(number));
-	if (ret < 0 || (size_t)ret >= sizeof(buffer)) return scm_error("number->string: number too big");
-	return scm_string(buffer, (size_t)ret);
+	char buffer[32];
+	return scm_string_copy(buffer, scm_number_format(scm_number_value(number), buffer));
 }
 
 #define SCM_COMPARE(name, sname, type, is_t, get_v, cmp)                  \
@@ -228,7 +225,7 @@ scm_obj_t name(scm_obj_t args)                                            \
 #define SCM_CMP_LE(x, y) (x <= y)
 #define SCM_CMP_GE(x, y) (x >= y)
 #define SCM_CMP_EQ(x, y) (x == y)
-#define SCM_CMP_STRING(x, y) (strcmp(x, y) == 0)
+#define SCM_STRING_SELF(x) (x)
 SCM_COMPARE(scm_char_lt, "char<?", int, scm_is_char, scm_char_value, SCM_CMP_LT)
 SCM_COMPARE(scm_char_gt, "char>?", int, scm_is_char, scm_char_value, SCM_CMP_GT)
 SCM_COMPARE(scm_char_le, "char<=?", int, scm_is_char, scm_char_value, SCM_CMP_LE)
@@ -244,7 +241,7 @@ SCM_COMPARE(scm_number_gt, ">", double, scm_is_number, scm_number_value, SCM_CMP
 SCM_COMPARE(scm_number_le, "<=", double, scm_is_number, scm_number_value, SCM_CMP_LE)
 SCM_COMPARE(scm_number_ge, ">=", double, scm_is_number, scm_number_value, SCM_CMP_GE)
 SCM_COMPARE(scm_number_eq, "=", double, scm_is_number, scm_number_value, SCM_CMP_EQ)
-SCM_COMPARE(scm_string_eq, "string=?", const char *, scm_is_string, scm_string_value, SCM_CMP_STRING)
+SCM_COMPARE(scm_string_eq, "string=?", scm_obj_t, scm_is_string, SCM_STRING_SELF, scm_string_equal)
 
 extern bool scm_is_equal(scm_obj_t obj1, scm_obj_t obj2)
 {
@@ -259,7 +256,7 @@ tail_recurse:
 	}
 
 	if (scm_is_string(obj1) && scm_is_string(obj2))
-		return (strcmp(scm_string_value(obj1), scm_string_value(obj2)) == 0);
+		return scm_string_equal(obj1, obj2);
 
 	return false;
 }
@@ -2,11 +2,25 @@
 #include "scm754.h"
 
 #define SCM_TOKEN_SIZE  128
-#define SCM_STRING_SIZE 512
 #define SCM_READ_DEPTH 32768U
 
 static size_t read_depth;
 
+/* The characters of the port being read, tokens are scanned in place */
+static scm_view_t in;
+
+static inline int next(void)
+{
+	if (in.pos == in.length && !scm_input_refill(&in)) return EOF;
+	return (unsigned char)in.data[in.pos++];
+}
+
+static inline int peek(void)
+{
+	if (in.pos == in.length && !scm_input_refill(&in)) return EOF;
+	return (unsigned char)in.data[in.pos];
+}
+
 /* R7RS, section 7.1.1, Lexical structure */
 static inline bool is_line_ending(int c) { return c == '\r' || c == '\n'; }
 static inline bool is_whitespace(int c) { return c == ' ' || c == '\t' || is_line_ending(c); }
@@ -19,15 +33,15 @@ static inline bool is_explicit_sign(int c) { return c == '+' || c == '-'; }
 
 static void skip_comment(void)
 {
-	int c;
-	while (((c = scm_read_char()) != EOF) && !is_line_ending(c));
+	while (in.pos < in.length && !is_line_ending(in.data[in.pos])) in.pos++;
+	if (in.pos < in.length) in.pos++;
 }
 
 static scm_obj_t read_boolean(int c)
 {
 	int c1;
 
-	c1 = scm_peek_char();
+	c1 = peek();
 	if (c1 == EOF || is_delimiter(c1)) {
 		if (c == 't' || c == 'T') return scm_true();
 		else if (c == 'f' || c == 'F') return scm_false();
@@ -40,47 +54,51 @@ static scm_obj_t read_char(void)
 {
 	int c, c1;
 
-	c = scm_read_char();
+	c = next();
 	if (c == EOF)
 		return scm_error("read_char: unexpected EOF after #\\");
 
-	c1 = scm_peek_char();
+	c1 = peek();
 	if (c1 == EOF || is_delimiter(c1))
 		return scm_char(c);
 
 	return scm_error("read_char: unexpected #\\%c%c", c, c1);
 }
 
-__attribute__((warn_unused_result))
-static ssize_t scan_token(char *buf, size_t size)
+/* Bumps the position over the rest of a token, which stays in the view.
+ * A token ends at the end of a line, so a refill never splits it. */
+static size_t scan_token(void)
 {
-	ssize_t i = 0, ssize = (ssize_t)size;
-	int c;
-
-	while (((c = scm_peek_char()) != EOF) && !is_delimiter(c) && (i < ssize)) {
-		scm_read_char();
-		buf[i++] = (char)c;
-	}
+	size_t start = in.pos;
+	while (in.pos < in.length && !is_delimiter((unsigned char)in.data[in.pos])) in.pos++;
+	return in.pos - start;
+}
 
-	if (i >= ssize) return -1;
+/* A number needs a NUL-terminated copy for strtod() */
+static scm_obj_t to_number(const char *token, size_t n, int radix)
+{
+	char buf[SCM_TOKEN_SIZE];
 
-	buf[i] = '\0';
-	return i;
+	if (n >= sizeof buf) return scm_false();
+	memcpy(buf, token, n);
+	buf[n] = '\0';
+	return scm_string_to_number(buf, radix);
 }
 
 static scm_obj_t read_number_radix(int radix)
 {
-	char buf[SCM_TOKEN_SIZE];
+	const char *token = in.data + in.pos;
+	size_t n = scan_token();
 
-	if (scan_token(buf, sizeof buf) <= 0)
+	if (n == 0 || n >= SCM_TOKEN_SIZE)
 		return scm_error("read_number_radix: scan error");
 
-	return scm_string_to_number(buf, radix);
+	return to_number(token, n, radix);
 }
 
 static scm_obj_t read_sharp(void)
 {
-	int c = scm_read_char();
+	int c = next();
 
 	if (c == 'f' || c == 'F' || c == 't' || c == 'T')
 		return read_boolean(c);
@@ -98,72 +116,65 @@ static scm_obj_t read_sharp(void)
 		return scm_error("read_sharp: unexpected #%c", c);
 }
 
-static scm_obj_t read_number(char c)
+/* The first character of these tokens was just read from the view */
+static scm_obj_t read_number(void)
 {
-	char buf[SCM_TOKEN_SIZE];
+	const char *token = in.data + in.pos - 1;
+	size_t n = 1 + scan_token();
 
-	buf[0] = c;
-	if (scan_token(buf + 1, sizeof buf - 1) < 0)
+	if (n >= SCM_TOKEN_SIZE)
 		return scm_error("read_number: scan error");
 
-	return scm_string_to_number(buf, 0);
+	return to_number(token, n, 0);
 }
 
-static scm_obj_t read_symbol(char c)
+static scm_obj_t read_symbol(void)
 {
-	char buf[SCM_TOKEN_SIZE];
-	ssize_t len;
-	scm_obj_t obj;
+	const char *token = in.data + in.pos - 1;
+	size_t n = 1 + scan_token();
 
-	buf[0] = c;
-	if ((len = scan_token(buf + 1, sizeof buf - 1)) < 0)
-		return scm_error("read_symbol: scan error");
-
-	obj = scm_string(buf, (size_t)len+1);
-	if (scm_is_error(obj)) return obj;
-
-	return scm_string_to_symbol(obj);
+	return scm_symbol(token, n);
 }
 
-static scm_obj_t read_symbol_or_number_or_dot(char c, bool dot_ok)
+static scm_obj_t read_symbol_or_number_or_dot(bool dot_ok)
 {
-	char buf[SCM_TOKEN_SIZE];
-	ssize_t len;
+	const char *token = in.data + in.pos - 1;
+	size_t n = 1 + scan_token();
 	scm_obj_t obj;
 
-	buf[0] = c;
-	if ((len = scan_token(buf + 1, sizeof buf - 1)) < 0)
-		return scm_error("read_symbol_or_number: scan error");
-
-	if (len == 0) {
-		if (c == '.') return dot_ok ? scm_dot() : scm_error("read: unexpected dot (.)");
+	if (n == 1) {
+		if (token[0] == '.') return dot_ok ? scm_dot() : scm_error("read: unexpected dot (.)");
 		goto make_symbol;
 	}
 
-	obj = scm_string_to_number(buf, 0);
+	obj = to_number(token, n, 0);
 	if (scm_boolean_value(obj)) return obj;
 
 make_symbol:
-	obj = scm_string(buf, (size_t)len+1);
-	if (scm_is_error(obj)) return obj;
-
-	return scm_string_to_symbol(obj);
+	return scm_symbol(token, n);
 }
 
+/* Usually the closing quote is in the view, only a string that spans
+ * lines of stdin is collected piece by piece */
 static scm_obj_t read_string(void)
 {
-	char buf[SCM_STRING_SIZE];
-	size_t n = 0;
-	int c;
+	scm_obj_t string = SCM_FALSE;
 
-	while (((c = scm_read_char()) != EOF) && (c != '"') && (n < sizeof buf))
-		buf[n++] = (char)c;
-
-	if (n >= sizeof buf) return scm_error("read_string: string too long");
-
-	buf[n] = 0;
-
-	return scm_string(buf, n);
+	while (1) {
+		const char *start = in.data + in.pos;
+		const char *quote = memchr(start, '"', in.length - in.pos);
+		size_t n = (quote != NULL) ? (size_t)(quote - start) : in.length - in.pos;
+
+		in.pos += n + (quote != NULL);
+		if (!scm_is_string(string)) {
+			if (quote != NULL) return scm_string_copy(start, n);
+			string = scm_string_buffer(n);
+			if (scm_is_error(string)) return string;
+		}
+		scm_obj_t result = scm_string_append_chars(string, start, n);
+		if (scm_is_error(result)) return result;
+		if (quote != NULL || !scm_input_refill(&in)) return string;
+	}
 }
 
 static scm_obj_t read(bool dot_ok, bool rparen_ok, bool eof_ok);
@@ -227,7 +238,7 @@ static scm_obj_t read(bool dot_ok, bool rparen_ok, bool eof_ok)
 		return scm_error("read: maximum recursion depth exceeded");
 
 	while (1) {
-		c = scm_read_char();
+		c = next();
 
 		if (is_whitespace(c))
 			continue;
@@ -246,37 +257,56 @@ static scm_obj_t read(bool dot_ok, bool rparen_ok, bool eof_ok)
 		else if (c == '#')
 			return read_sharp();
 		else if (is_digit(c))
-			return read_number((char)c);
+			return read_number();
 		else if (is_initial(c))
-			return read_symbol((char)c);
+			return read_symbol();
 		else if (is_explicit_sign(c) || c == '.')
-			return read_symbol_or_number_or_dot((char)c, dot_ok);
+			return read_symbol_or_number_or_dot(dot_ok);
 		else
 			return scm_error("read: unexpected %c", c);
 	}
 }
 
-extern scm_obj_t scm_read(void)
+extern scm_obj_t scm_read_port(scm_obj_t port)
 {
+	if (!scm_input_begin(port, &in)) return scm_error("read: needs an input port");
 	read_depth = 0;
-	return read(0, 0, 1);
+	scm_obj_t obj = read(0, 0, 1);
+	scm_input_end(&in);
+	return obj;
+}
+
+extern scm_obj_t scm_read(void)
+{
+	return scm_read_port(scm_current_input_port);
+}
+
+/* (read-char [port]) and (peek-char [port]) */
+extern scm_obj_t scm_read_char(scm_obj_t args, bool peeking)
+{
+	scm_obj_t port = scm_is_null(args) ? scm_current_input_port : scm_car(args);
+	if (!scm_input_begin(port, &in)) return scm_error("read-char: needs an input port");
+	int c = peeking ? peek() : next();
+	scm_input_end(&in);
+	return (c == EOF) ? scm_eof_object() : scm_char(c);
 }
 
+/* Reads the forms of the file through a port of its own, the current
+ * input port stays as it is */
 extern scm_obj_t scm_load(const char *filename)
 {
 	scm_obj_t obj;
-	FILE *f = fopen(filename, "r");
-	if (f == NULL) return scm_error("cant open file %s", filename);
-	FILE *saved = scm_current_input_port;
-	scm_current_input_port = f;
+	scm_obj_t port = scm_open_input_file(filename);
+	if (scm_is_error(port)) return port;
+	scm_gc_push(&port);
 	while (1) {
-		obj = scm_read();
+		obj = scm_read_port(port);
 		if (scm_is_eof_object(obj)) break;
 		else if (scm_is_error(obj)) break;
 		obj = scm_eval(obj, scm_interaction_environment);
 		if (scm_is_error(obj)) break;
 	}
-	scm_current_input_port = saved;
-	fclose(f);
+	(void)scm_close_port(port);
+	scm_gc_pop();
 	return obj;
 }
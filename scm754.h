@@ -16,6 +16,14 @@ typedef uint64_t scm_obj_t;
 
 /* Tags for scm_obj_t */
 #define SCM_MASK         0xffff000000000000
+/* Do not use: +inf      0x7ff0000000000000 */
+#define SCM_CODE         0x7ff1000000000000
+#define SCM_PORT         0x7ff2000000000000
+#define SCM_LOCAL        0x7ff3000000000000
+#define SCM_FRAME        0x7ff4000000000000
+#define SCM_ENV          0x7ff5000000000000
+#define SCM_NODE         0x7ff6000000000000
+/* Do not use: +nan      0x7ff8000000000000 */
 /* Do not use: -inf      0xfff0000000000000 */
 #define SCM_NIL          0xfff1000000000000
 #define SCM_TRUE         0xfff2000000000000
@@ -110,7 +118,25 @@ typedef enum {
 	SCM_OP_STRING_SET,
 	SCM_OP_LIST_REF,
 	SCM_OP_SUBSTRING,
-	SCM_OP_PROCEDURE_LAST = SCM_OP_SUBSTRING,
+	SCM_OP_MAKE_STRING,
+	SCM_OP_GC_STATS,
+	SCM_OP_RUNTIME_STATS,
+	SCM_OP_STRING_APPEND,
+	SCM_OP_OPEN_OUTPUT_STRING,
+	SCM_OP_GET_OUTPUT_STRING,
+	SCM_OP_WITH_OUTPUT_TO_STRING,
+	SCM_OP_CURRENT_OUTPUT_PORT,
+	SCM_OP_OPEN_INPUT_STRING,
+	SCM_OP_OPEN_INPUT_FILE,
+	SCM_OP_CLOSE_PORT,
+	SCM_OP_READ,
+	SCM_OP_READ_CHAR,
+	SCM_OP_PEEK_CHAR,
+	SCM_OP_IS_INPUT_PORT,
+	SCM_OP_IS_OUTPUT_PORT,
+	SCM_OP_OPEN_OUTPUT_FILE,
+	SCM_OP_FLUSH_OUTPUT_PORT,
+	SCM_OP_PROCEDURE_LAST = SCM_OP_FLUSH_OUTPUT_PORT,
 } scm_op_t;
 
 typedef struct
@@ -119,15 +145,133 @@ typedef struct
 	scm_obj_t cdr;
 } scm_pair_t;
 
-#define SCM_CELL_NUM  32768U
-extern scm_pair_t cell[SCM_CELL_NUM];
-extern size_t cell_head;
+/* Cell heap: reserved once for the maximum heap size and mapped segment by
+ * segment on demand, so a pair stays a 32-bit index. Only the copying mode
+ * moves the base, between two such reservations. */
+#define SCM_SEGMENT_SIZE  (2U << 20) /* one huge page */
+#define SCM_SEGMENT_CELLS (SCM_SEGMENT_SIZE / sizeof(scm_pair_t))
+extern scm_pair_t *cell;
+extern size_t cell_head;  /* next free cell */
+extern size_t cell_limit; /* end of its run */
+extern size_t cell_free;  /* fallback free list through car_next */
+
+/* Allocation drives collection: scm_cons() counts cells against a budget,
+ * scm_string() requests a collection when its slots run low. Collection
+ * itself waits for the next safe point, see scm_gc_collect(). */
+extern size_t cell_alloc;
+extern bool scm_gc_requested;
+
+/* Heap sizes in bytes and target occupancy of the old generation in
+ * percent, read by scm_gc_init() and scm_gc_collect() */
+extern size_t scm_heap_initial;
+extern size_t scm_heap_maximum;
+extern unsigned scm_heap_occupancy;
+
+/* Number of marking threads, read by the first collection */
+extern unsigned scm_gc_threads;
+
+/* Mark full collections on a background thread */
+extern bool scm_gc_concurrent;
+
+/* Copy the live cells instead of marking and sweeping, set before init */
+extern bool scm_gc_copy;
+
+/* Runtime statistics, kept by the runtime itself, see stats.c */
+#define SCM_PAUSE_BUCKETS 24U /* pause < 2^k us, the last one unbounded */
+typedef struct
+{
+	uint64_t conses; /* until the last collection, plus cell_alloc */
+	uint64_t strings;
+	uint64_t string_bytes;
+	uint64_t collections;
+	uint64_t full_collections;
+	uint64_t cells_marked;
+	uint64_t cells_freed;
+	uint64_t strings_marked;
+	uint64_t strings_freed;
+	uint64_t heap_cells;
+	uint64_t live_cells;
+	uint64_t pause_ns;
+	uint64_t pause_max_ns;
+	uint64_t pauses[SCM_PAUSE_BUCKETS];
+	uint64_t stack_peak;
+	uint64_t evals;
+	uint64_t applies;
+	uint64_t tail_calls;
+	uint64_t instructions;
+} scm_stats_t;
+extern scm_stats_t scm_stats;
+extern void scm_stats_pause(uint64_t ns);
+extern scm_obj_t scm_gc_stats(void);
+extern scm_obj_t scm_runtime_stats(void);
+extern void scm_stats_print(FILE *f);
 
 /* Default environment for REPL */
 extern scm_obj_t scm_interaction_environment;
 
+/* Input ports: the reader scans a view of a port's characters */
+typedef struct {
+	scm_obj_t port;
+	const char *data;
+	size_t pos;
+	size_t length;
+} scm_view_t;
+
 /* Default input port */
-extern FILE *scm_current_input_port;
+extern scm_obj_t scm_current_input_port;
+extern scm_obj_t scm_open_stdin(void);
+extern scm_obj_t scm_open_input_string(scm_obj_t string);
+extern scm_obj_t scm_open_input_file(const char *filename);
+extern scm_obj_t scm_close_port(scm_obj_t port);
+extern bool scm_is_input_port(scm_obj_t obj);
+extern bool scm_is_output_port(scm_obj_t obj);
+extern bool scm_input_begin(scm_obj_t port, scm_view_t *view);
+extern void scm_input_end(const scm_view_t *view);
+extern bool scm_input_refill(scm_view_t *view);
+
+/* Default output port, stdout unless redirected by with-output-to-string */
+extern scm_obj_t scm_current_output_port;
+extern scm_obj_t scm_open_stdout(void);
+extern scm_obj_t scm_open_output_string(void);
+extern scm_obj_t scm_open_output_file(const char *filename);
+extern scm_obj_t scm_port_write(scm_obj_t port, const char *chars, size_t n);
+extern void scm_stdout_write(const char *chars, size_t n);
+extern scm_obj_t scm_flush_output_port(scm_obj_t args);
+extern void scm_flush_all(void);
+extern scm_obj_t scm_get_output_string(scm_obj_t port);
+extern scm_obj_t scm_with_output_to_string(scm_obj_t thunk);
+
+/* Global variables: the value of each symbol, roots of the collector, set
+ * through scm_env_define() for its remembered set */
+extern scm_obj_t *scm_globals;
+extern uint32_t scm_symbol_num;
+
+/* Bytecode machine, run by scm_eval() if scm_vm is set. Its value stack is
+ * a root of the collector too, its code lives in the heap. */
+extern bool scm_vm;
+extern scm_obj_t *scm_vm_stack;
+extern size_t scm_vm_sp;
+extern scm_obj_t scm_vm_execute(scm_obj_t expr);
+
+/* Garbage collector: map another heap segment, find the next free run */
+extern bool scm_gc_grow(void);
+extern size_t scm_gc_sweep(void);
+extern size_t scm_gc_block(size_t n);
+
+/* Garbage collector: write barrier, remembers old cells which are mutated */
+extern uint64_t *mark_bits;
+extern void scm_gc_remember(size_t i);
+extern void scm_gc_remember_global(uint32_t k);
+static inline void scm_gc_barrier(size_t i)
+{
+	if (mark_bits[i/64] & (1ULL << (i%64))) scm_gc_remember(i);
+}
+
+/* Garbage collector: while marking concurrently, allocate black and log
+ * overwritten values */
+extern bool scm_gc_marking;
+extern void scm_gc_black(size_t i);
+extern void scm_gc_log(scm_obj_t obj);
 
 /* Error reporting */
 __attribute__((noreturn, nonnull))
@@ -150,6 +294,16 @@ static inline bool scm_is_pair(scm_obj_t obj)         { return (obj & SCM_MASK)
 static inline bool scm_is_char(scm_obj_t obj)         { return (obj & SCM_MASK) == SCM_CHAR; }
 static inline bool scm_is_procedure(scm_obj_t obj)    { return (obj & SCM_MASK) == SCM_PROCEDURE; }
 static inline bool scm_is_closure(scm_obj_t obj)      { return (obj & SCM_MASK) == SCM_CLOSURE; }
+static inline bool scm_is_port(scm_obj_t obj)         { return (obj & SCM_MASK) == SCM_PORT; }
+static inline bool scm_is_local(scm_obj_t obj)        { return (obj & SCM_MASK) == SCM_LOCAL; }
+static inline bool scm_is_frame(scm_obj_t obj)        { return (obj & SCM_MASK) == SCM_FRAME; }
+static inline bool scm_is_env(scm_obj_t obj)          { return (obj & SCM_MASK) == SCM_ENV; }
+static inline bool scm_is_node(scm_obj_t obj)         { return (obj & SCM_MASK) == SCM_NODE; }
+static inline bool scm_is_code(scm_obj_t obj)         { return (obj & SCM_MASK) == SCM_CODE; }
+/* Objects that are cells to the collector. An environment frame and the
+ * code of the bytecode machine are blocks of them, see scm_env_frame() */
+static inline bool scm_is_block(scm_obj_t obj)        { return scm_is_env(obj) || scm_is_code(obj); }
+static inline bool scm_is_cell(scm_obj_t obj)         { return scm_is_pair(obj) || scm_is_closure(obj) || scm_is_port(obj) || scm_is_block(obj); }
 static inline bool scm_is_number(scm_obj_t obj)
 {
 	scm_obj_t exp = (obj >> 52) & 0x7FF;
@@ -168,11 +322,21 @@ static inline size_t scm_number_to_size(scm_obj_t number)
 }
 static inline int scm_char_value(scm_obj_t c)                { return (int)(uint32_t)c; }
 static inline scm_obj_t scm_closure_value(scm_obj_t closure) { return SCM_PAIR | (uint32_t)closure; }
+static inline scm_obj_t scm_port_value(scm_obj_t port)       { return SCM_PAIR | (uint32_t)port; }
 static inline uint32_t scm_procedure_id(scm_obj_t procedure) { return (uint32_t)procedure; }
+static inline uint32_t scm_local_depth(scm_obj_t local)      { return (uint32_t)(local >> 16) & 0xffff; }
+static inline uint32_t scm_local_index(scm_obj_t local)      { return (uint32_t)local & 0xffff; }
+static inline uint32_t scm_frame_params(scm_obj_t frame)     { return (uint32_t)frame & 0xffff; }
+static inline bool scm_frame_rest(scm_obj_t frame)           { return (frame >> 16) & 1; }
+static inline uint32_t scm_frame_slots(scm_obj_t frame)      { return (uint32_t)(frame >> 17) & 0xffff; }
+static inline uint32_t scm_node_op(scm_obj_t node)           { return (uint32_t)(node >> 32) & 0xffff; }
+static inline uint32_t scm_node_argc(scm_obj_t node)         { return (uint32_t)node; }
 extern int8_t scm_procedure_arity(scm_obj_t proc);
 extern const char *scm_procedure_string(scm_obj_t proc);
-extern char *scm_string_value(scm_obj_t string);
-static inline size_t scm_string_length(scm_obj_t string)     { assert(scm_is_string(string)); return strlen(scm_string_value(string)); }
+extern const char *scm_string_value(scm_obj_t string);
+extern char *scm_string_mutable(scm_obj_t string);
+extern size_t scm_string_length(scm_obj_t string);
+extern bool scm_string_equal(scm_obj_t a, scm_obj_t b);
 static inline scm_obj_t scm_car(scm_obj_t pair)
 {
 	if (!scm_is_pair(pair)) return scm_error("car: not a pair");
@@ -200,12 +364,31 @@ static inline scm_obj_t scm_number(double number)   { scm_obj_t d; memcpy(&d, &n
 static inline scm_obj_t scm_char(int c)             { return SCM_CHAR | (uint32_t)c; }
 static inline scm_obj_t scm_procedure(uint32_t id)  { return SCM_PROCEDURE | id; }
 static inline scm_obj_t scm_closure(scm_obj_t pair) { return SCM_CLOSURE | (uint32_t)pair; }
+static inline scm_obj_t scm_port(scm_obj_t pair)    { return SCM_PORT | (uint32_t)pair; }
+/* Lexical address of a local variable: the frame, counted outwards, and the
+ * variable in it */
+static inline scm_obj_t scm_local(uint32_t depth, uint32_t index) { return SCM_LOCAL | (scm_obj_t)depth << 16 | index; }
+/* Frame layout of a resolved lambda: the number of parameters, whether the
+ * last one takes the rest of the arguments, and the number of slots */
+static inline scm_obj_t scm_frame(uint32_t params, bool rest, uint32_t slots) { return SCM_FRAME | (scm_obj_t)slots << 17 | (scm_obj_t)rest << 16 | params; }
+/* Head of an analyzed form: the SCM_OP_* of the special form, SCM_OP_APPLY
+ * for an application, and the number of its arguments */
+static inline scm_obj_t scm_node(uint32_t op, uint32_t argc)      { return SCM_NODE | (scm_obj_t)op << 32 | argc; }
 extern scm_obj_t scm_string(const char *string, size_t k);
+extern scm_obj_t scm_string_copy(const char *string, size_t n);
+extern scm_obj_t scm_string_slice(scm_obj_t string, size_t start, size_t n);
+extern scm_obj_t scm_string_buffer(size_t n);
+extern scm_obj_t scm_string_append_chars(scm_obj_t string, const char *chars, size_t n);
+extern scm_obj_t scm_string_append(scm_obj_t args);
+extern scm_obj_t scm_make_string(scm_obj_t args);
 static inline scm_obj_t scm_cons(scm_obj_t obj1, scm_obj_t obj2)
 {
-	if (cell_head == UINT64_MAX) scm_fatal("out of cell memory");
-	size_t i = cell_head;
-	cell_head = cell[i].car_next;
+	size_t i;
+	if (cell_head < cell_limit) i = cell_head++;
+	else if (cell_free != UINT64_MAX) i = cell_free, cell_free = cell[i].car_next;
+	else i = scm_gc_sweep();
+	cell_alloc++;
+	if (scm_gc_marking) scm_gc_black(i);
 	cell[i].car_next = obj1;
 	cell[i].cdr = obj2;
 	return SCM_PAIR | i;
@@ -215,7 +398,10 @@ static inline scm_obj_t scm_cons(scm_obj_t obj1, scm_obj_t obj2)
 static inline scm_obj_t scm_set_car(scm_obj_t pair, scm_obj_t obj)
 {
 	if (!scm_is_pair(pair)) return scm_error("set-car!: not a pair");
-	cell[(uint32_t)pair].car_next = obj;
+	size_t i = (uint32_t)pair;
+	scm_gc_barrier(i);
+	if (scm_gc_marking) scm_gc_log(cell[i].car_next);
+	__atomic_store_n(&cell[i].car_next, obj, __ATOMIC_RELAXED); /* read by the marker */
 	return scm_unspecified();
 }
 static inline scm_obj_t scm_set_cdr(scm_obj_t pair, scm_obj_t obj)
@@ -223,7 +409,9 @@ static inline scm_obj_t scm_set_cdr(scm_obj_t pair, scm_obj_t obj)
 	if (!scm_is_pair(pair)) return scm_error("set-cdr!: not a pair");
 	size_t i = (uint32_t)pair;
 	assert(cell[i].cdr != SCM_ERROR);
-	cell[i].cdr = obj;
+	scm_gc_barrier(i);
+	if (scm_gc_marking) scm_gc_log(cell[i].cdr);
+	__atomic_store_n(&cell[i].cdr, obj, __ATOMIC_RELAXED);
 	return scm_unspecified();
 }
 
@@ -231,20 +419,21 @@ static inline scm_obj_t scm_set_cdr(scm_obj_t pair, scm_obj_t obj)
 extern scm_obj_t scm_write(scm_obj_t obj);
 extern scm_obj_t scm_display(scm_obj_t obj);
 extern scm_obj_t scm_newline(void);
+extern scm_obj_t scm_write_port(scm_obj_t args, bool readable);
+extern scm_obj_t scm_newline_port(scm_obj_t args);
 extern scm_obj_t scm_read(void);
 extern scm_obj_t scm_load(const char *filename);
 extern scm_obj_t scm_eval(scm_obj_t expr, scm_obj_t env);
 extern scm_obj_t scm_apply(scm_obj_t proc, scm_obj_t args);
-extern int scm_read_char(void);
-extern int scm_peek_char(void);
+extern scm_obj_t scm_read_port(scm_obj_t port);
+extern scm_obj_t scm_read_char(scm_obj_t args, bool peeking);
 extern scm_obj_t scm_number_to_string(scm_obj_t number);
+extern size_t scm_number_format(double x, char *buf);
 extern scm_obj_t scm_string_to_symbol(scm_obj_t string);
+extern scm_obj_t scm_symbol(const char *name, size_t n);
+extern const char *scm_symbol_name(scm_obj_t symbol);
+extern size_t scm_symbol_length(scm_obj_t symbol);
 extern scm_obj_t scm_string_to_number(const char *string, int radix);
-static inline scm_obj_t scm_symbol_to_string(scm_obj_t symbol)
-{
-	if (!scm_is_symbol(symbol)) return scm_error("not a symbol");
-	return SCM_STRING | (uint32_t)symbol;
-}
 extern scm_obj_t scm_add(scm_obj_t args);
 extern scm_obj_t scm_sub(scm_obj_t args);
 extern scm_obj_t scm_mul(scm_obj_t args);
@@ -292,19 +481,26 @@ extern scm_obj_t scm_list_ref(scm_obj_t list, scm_obj_t k);
 
 /* Environment */
 extern scm_obj_t scm_env_create(void);
-extern scm_obj_t scm_env_lookup(scm_obj_t env, scm_obj_t symbol);
-extern void scm_env_define(scm_obj_t env, scm_obj_t symbol, scm_obj_t value);
-extern scm_obj_t scm_env_extend(scm_obj_t env, scm_obj_t params, scm_obj_t args);
+extern scm_obj_t scm_env_lookup(scm_obj_t symbol);
+extern void scm_env_define(scm_obj_t symbol, scm_obj_t value);
+extern scm_obj_t scm_env_ref(scm_obj_t env, scm_obj_t local);
+extern void scm_env_set(scm_obj_t env, scm_obj_t local, scm_obj_t value);
+extern scm_obj_t scm_env_frame(scm_obj_t env, scm_obj_t layout);
 
 /* Garbage collector */
 extern void scm_gc_init(void);
 extern void scm_gc_collect(void);
-extern void scm_gc_push(const scm_obj_t *obj);
+extern void scm_gc_push(scm_obj_t *obj);
 extern void scm_gc_pop(void);
-extern void scm_gc_push2(const scm_obj_t *obj1, const scm_obj_t *obj2);
+extern void scm_gc_push2(scm_obj_t *obj1, scm_obj_t *obj2);
 extern void scm_gc_pop2(void);
 extern void scm_gc_string_init(void);
 extern void scm_gc_string_mark(scm_obj_t string);
-extern void scm_gc_string_sweep(void);
+extern void scm_gc_string_mark_next(scm_obj_t string);
+extern void scm_gc_string_begin(void);
+extern void scm_gc_string_flip(void);
+extern bool scm_gc_string_sweep(bool full);
+extern void scm_gc_string_unmark(void);
 extern void scm_gc_string_free(void);
+extern void scm_gc_string_compact(void);
 #endif
@@ -0,0 +1,98 @@
+/* (c) guenter.ebermann@htl-hl.ac.at */
+#include "scm754.h"
+
+scm_stats_t scm_stats;
+
+typedef struct {
+	const char *name;
+	const uint64_t *value;
+} scm_counter_t;
+
+static const scm_counter_t gc_counters[] =
+{
+	{ "conses", &scm_stats.conses },
+	{ "strings", &scm_stats.strings },
+	{ "string-bytes", &scm_stats.string_bytes },
+	{ "collections", &scm_stats.collections },
+	{ "full-collections", &scm_stats.full_collections },
+	{ "cells-marked", &scm_stats.cells_marked },
+	{ "cells-freed", &scm_stats.cells_freed },
+	{ "strings-marked", &scm_stats.strings_marked },
+	{ "strings-freed", &scm_stats.strings_freed },
+	{ "heap-cells", &scm_stats.heap_cells },
+	{ "live-cells", &scm_stats.live_cells },
+	{ "pause-total-ns", &scm_stats.pause_ns },
+	{ "pause-max-ns", &scm_stats.pause_max_ns },
+};
+
+static const scm_counter_t runtime_counters[] =
+{
+	{ "evals", &scm_stats.evals },
+	{ "applies", &scm_stats.applies },
+	{ "tail-calls", &scm_stats.tail_calls },
+	{ "instructions", &scm_stats.instructions },
+	{ "stack-peak", &scm_stats.stack_peak },
+};
+
+extern void scm_stats_pause(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned k = 0;
+
+	while (k < SCM_PAUSE_BUCKETS - 1 && us >= (1ULL << k)) k++;
+	scm_stats.pauses[k]++;
+	scm_stats.collections++;
+	scm_stats.pause_ns += ns;
+	if (ns > scm_stats.pause_max_ns) scm_stats.pause_max_ns = ns;
+}
+
+/* conses are only summed up at collections */
+static uint64_t value(const scm_counter_t *c)
+{
+	return *c->value + ((c->value == &scm_stats.conses) ? cell_alloc : 0);
+}
+
+static scm_obj_t symbol(const char *name)
+{
+	return scm_symbol(name, strlen(name));
+}
+
+static scm_obj_t alist(const scm_counter_t *counters, size_t n, scm_obj_t tail)
+{
+	scm_obj_t list = tail;
+	for (size_t i = n; i-- > 0; )
+		list = scm_cons(scm_cons(symbol(counters[i].name), scm_number((double)value(&counters[i]))), list);
+	return list;
+}
+
+/* ((conses . n) ... (pauses (16 . n) ...)), a pause bucket is keyed by its
+ * bound in microseconds, the last one by +inf */
+extern scm_obj_t scm_gc_stats(void)
+{
+	scm_obj_t pauses = scm_nil();
+	for (unsigned k = SCM_PAUSE_BUCKETS; k-- > 0; ) {
+		double bound = (k == SCM_PAUSE_BUCKETS - 1) ? INFINITY : (double)(1ULL << k);
+		if (scm_stats.pauses[k] != 0)
+			pauses = scm_cons(scm_cons(scm_number(bound), scm_number((double)scm_stats.pauses[k])), pauses);
+	}
+	pauses = scm_cons(scm_cons(symbol("pauses"), pauses), scm_nil());
+	return alist(gc_counters, sizeof(gc_counters)/sizeof(gc_counters[0]), pauses);
+}
+
+extern scm_obj_t scm_runtime_stats(void)
+{
+	return alist(runtime_counters, sizeof(runtime_counters)/sizeof(runtime_counters[0]), scm_nil());
+}
+
+extern void scm_stats_print(FILE *f)
+{
+	for (size_t i = 0; i < sizeof(gc_counters)/sizeof(gc_counters[0]); i++)
+		fprintf(f, "; %-18s %llu\n", gc_counters[i].name, (unsigned long long)value(&gc_counters[i]));
+	for (unsigned k = 0; k < SCM_PAUSE_BUCKETS; k++) {
+		if (scm_stats.pauses[k] == 0) continue;
+		if (k == SCM_PAUSE_BUCKETS - 1) fprintf(f, "; pauses >= %-8llu us %llu\n", 1ULL << (k - 1), (unsigned long long)scm_stats.pauses[k]);
+		else fprintf(f, "; pauses <  %-8llu us %llu\n", 1ULL << k, (unsigned long long)scm_stats.pauses[k]);
+	}
+	for (size_t i = 0; i < sizeof(runtime_counters)/sizeof(runtime_counters[0]); i++)
+		fprintf(f, "; %-18s %llu\n", runtime_counters[i].name, (unsigned long long)value(&runtime_counters[i]));
+}
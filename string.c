@@ -1,61 +1,286 @@
 /* (c) guenter.ebermann@htl-hl.ac.at */
 #include "scm754.h"
 
-#define SCM_STRING_NUM 2048U
+/* The slot table grows by chunks, which never move, so the concurrent
+ * marker can keep using them while the mutator adds more. */
+#define SCM_STRING_CHUNK  4096U
+#define SCM_STRING_CHUNKS 65536U
 
+/* Request a collection when less than 1/N of the slots are free */
+#define SCM_STRING_LOW 4U
+
+/* A block of characters, shared by the strings sliced from it and freed
+ * with the last of them. It is copied before a shared string is changed. */
 typedef struct
 {
-	char *string;
-	uint32_t next;
-	uint8_t mark;
+	uint32_t capacity;
+	uint32_t refs; /* 0 once moved by the compaction */
+	char data[];
+} scm_chars_t;
+
+typedef struct
+{
+	scm_chars_t *chars;
+	uint32_t offset;
+	uint32_t length;
 } scm_string_t;
 
-static scm_string_t strings[SCM_STRING_NUM];
-static uint32_t head = 0;
+/* The allocator sees the mark bits, the concurrent marker sets the next
+ * bits, which become the mark bits at the end of its cycle */
+typedef struct
+{
+	uint64_t mark[SCM_STRING_CHUNK / 64];
+	uint64_t next[SCM_STRING_CHUNK / 64];
+	scm_string_t strings[SCM_STRING_CHUNK];
+} scm_string_chunk_t;
+
+/* String heap: the characters are bump allocated from large pages, a dead
+ * string's block goes onto the free list of its 8 byte size class. Only
+ * strings larger than the biggest class get a malloc() of their own. A
+ * full collection compacts the pages once they are mostly free, the slots
+ * are the only references to the blocks. A block has a NUL after its
+ * capacity, but slices are not terminated. */
+#define SCM_PAGE_SIZE  (256U << 10)
+#define SCM_CLASS_NUM  64U
+#define SCM_CLASS_SIZE 8U
+#define SCM_BLOCK_SIZE(capacity) ((sizeof(scm_chars_t) + (capacity) + 1 + SCM_CLASS_SIZE - 1) & ~(size_t)(SCM_CLASS_SIZE - 1))
+
+typedef struct scm_page
+{
+	struct scm_page *next;
+	char data[];
+} scm_page_t;
+
+static scm_page_t *pages;
+static char *bump, *bump_end;
+static void *free_list[SCM_CLASS_NUM + 1]; /* by block size / 8 */
+static size_t page_bytes;
+
+/* Sweeping is lazy like for the cells: scm_string() frees and reuses the
+ * next unmarked slot at the sweep cursor, a collection restarts it. */
+static scm_string_chunk_t *chunks[SCM_STRING_CHUNKS];
+static uint32_t string_num; /* slots in all chunks */
+static uint32_t sweep_index;
+static uint32_t marked_num;
+static uint32_t used_num; /* marked and allocated since the collection */
+static uint32_t next_num; /* marked by the concurrent marker */
+
+static inline scm_string_t *slot(uint32_t i)
+{
+	return &chunks[i / SCM_STRING_CHUNK]->strings[i % SCM_STRING_CHUNK];
+}
+
+static inline bool marked(uint32_t i)
+{
+	return chunks[i / SCM_STRING_CHUNK]->mark[i % SCM_STRING_CHUNK / 64] & (1ULL << (i % 64));
+}
+
+static inline bool low(void)
+{
+	return used_num > string_num - string_num / SCM_STRING_LOW;
+}
+
+static bool grow(void)
+{
+	uint32_t k = string_num / SCM_STRING_CHUNK;
+	if (k == SCM_STRING_CHUNKS) return false;
+
+	scm_string_chunk_t *chunk = calloc(1, sizeof(scm_string_chunk_t));
+	if (chunk == NULL) return false;
+	__atomic_store_n(&chunks[k], chunk, __ATOMIC_RELEASE);
+	string_num += SCM_STRING_CHUNK;
+	return true;
+}
+
+static void mark_bit(uint64_t *bits, uint32_t i, uint32_t *num)
+{
+	uint64_t bit = 1ULL << (i % 64);
+	bits += i % SCM_STRING_CHUNK / 64;
+
+	/* atomic for the parallel and the concurrent marker */
+	if (__atomic_load_n(bits, __ATOMIC_RELAXED) & bit) return;
+	if (__atomic_fetch_or(bits, bit, __ATOMIC_RELAXED) & bit) return;
+	__atomic_fetch_add(num, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&scm_stats.strings_marked, 1, __ATOMIC_RELAXED);
+}
 
 extern void scm_gc_string_mark(scm_obj_t obj)
 {
-	assert(scm_is_string(obj) || scm_is_symbol(obj));
+	assert(scm_is_string(obj));
 	uint32_t i = (uint32_t)obj;
+	scm_string_chunk_t *chunk = chunks[i / SCM_STRING_CHUNK];
+
+	assert(chunk != NULL && chunk->strings[i % SCM_STRING_CHUNK].chars != NULL);
+	mark_bit(chunk->mark, i, &marked_num);
+}
 
-	assert(i < SCM_STRING_NUM);
-	assert(strings[i].string != NULL);
+extern void scm_gc_string_mark_next(scm_obj_t obj)
+{
+	assert(scm_is_string(obj));
+	uint32_t i = (uint32_t)obj;
+	scm_string_chunk_t *chunk = __atomic_load_n(&chunks[i / SCM_STRING_CHUNK], __ATOMIC_ACQUIRE);
 
-	strings[i].mark = 1;
+	assert(chunk != NULL);
+	mark_bit(chunk->next, i, &next_num);
 }
 
-extern void scm_gc_string_sweep(void)
+extern void scm_gc_string_begin(void)
 {
-	uint32_t tail = UINT32_MAX;
-	for (uint32_t i = 0; i < SCM_STRING_NUM; i++) {
-		scm_string_t *x = &strings[i];
-		if (!x->mark) {
-			free(x->string);
-			x->string = NULL;
-			x->next = tail;
-			tail = i;
-		}
-		x->mark = 0;
-	}
-	head = tail;
+	for (uint32_t k = 0; k < string_num / SCM_STRING_CHUNK; k++)
+		memset(chunks[k]->next, 0, sizeof(chunks[k]->next));
+	next_num = 0;
+}
+
+extern void scm_gc_string_flip(void)
+{
+	for (uint32_t k = 0; k < string_num / SCM_STRING_CHUNK; k++)
+		memcpy(chunks[k]->mark, chunks[k]->next, sizeof(chunks[k]->mark));
+	marked_num = next_num;
+}
+
+/* Marks are sticky like those of the cells, only a full collection
+ * clears them. The table grows when a full collection leaves too few
+ * slots. Returns true when they still run low. */
+extern bool scm_gc_string_sweep(bool full)
+{
+	sweep_index = 0;
+	used_num = marked_num;
+	while (full && low() && grow());
+	return low();
+}
+
+extern void scm_gc_string_unmark(void)
+{
+	for (uint32_t k = 0; k < string_num / SCM_STRING_CHUNK; k++)
+		memset(chunks[k]->mark, 0, sizeof(chunks[k]->mark));
+	marked_num = 0;
 }
 
 extern void scm_gc_string_init(void)
 {
-	for (uint32_t i = 0; i < SCM_STRING_NUM; i++) {
-		strings[i].next = ((i + 1) < SCM_STRING_NUM) ? i + 1 : UINT32_MAX;
-		strings[i].string = NULL;
+	scm_gc_string_free();
+	if (!grow()) scm_fatal("out of string memory");
+	sweep_index = 0;
+	marked_num = 0;
+	used_num = 0;
+}
+
+static void free_pages(scm_page_t *page)
+{
+	while (page != NULL) {
+		scm_page_t *next = page->next;
+		free(page);
+		page = next;
 	}
-	head = 0;
 }
 
 extern void scm_gc_string_free(void)
 {
-	for (uint32_t i = 0; i < SCM_STRING_NUM; i++)
-		free(strings[i].string);
+	/* the small blocks go with their pages */
+	for (uint32_t i = 0; i < string_num; i++) {
+		scm_chars_t *chars = slot(i)->chars;
+		if (chars != NULL && --chars->refs == 0 && SCM_BLOCK_SIZE(chars->capacity) > SCM_CLASS_NUM * SCM_CLASS_SIZE)
+			free(chars);
+	}
+	for (uint32_t k = 0; k < string_num / SCM_STRING_CHUNK; k++) {
+		free(chunks[k]);
+		chunks[k] = NULL;
+	}
+	string_num = 0;
+	free_pages(pages);
+	pages = NULL;
+	bump = bump_end = NULL;
+	memset(free_list, 0, sizeof(free_list));
+	page_bytes = 0;
+}
+
+static void *block_alloc(size_t size)
+{
+	if (size > SCM_CLASS_NUM * SCM_CLASS_SIZE) return malloc(size);
+
+	void **head = &free_list[size / SCM_CLASS_SIZE];
+	if (*head != NULL) {
+		void *block = *head;
+		*head = *(void **)block;
+		return block;
+	}
+
+	if ((size_t)(bump_end - bump) < size) {
+		scm_page_t *page = malloc(sizeof(scm_page_t) + SCM_PAGE_SIZE);
+		if (page == NULL) return NULL;
+		page->next = pages;
+		pages = page;
+		page_bytes += SCM_PAGE_SIZE;
+		bump = page->data;
+		bump_end = page->data + SCM_PAGE_SIZE;
+	}
+	void *block = bump;
+	bump += size;
+	return block;
+}
+
+static void block_free(scm_chars_t *chars)
+{
+	size_t size = SCM_BLOCK_SIZE(chars->capacity);
+	if (size > SCM_CLASS_NUM * SCM_CLASS_SIZE) {
+		free(chars);
+		return;
+	}
+	*(void **)chars = free_list[size / SCM_CLASS_SIZE];
+	free_list[size / SCM_CLASS_SIZE] = chars;
+}
+
+static void block_release(scm_chars_t *chars)
+{
+	if (--chars->refs == 0) block_free(chars);
 }
 
-extern char *scm_string_value(scm_obj_t string)
+/* After a full collection every unmarked slot is dead. Copies the live
+ * strings into fresh pages once less than half of the pages is in use. */
+extern void scm_gc_string_compact(void)
+{
+	size_t live = 0;
+	for (uint32_t i = 0; i < string_num; i++) {
+		scm_chars_t *chars = slot(i)->chars;
+		if (chars == NULL) continue;
+		if (!marked(i)) {
+			block_release(chars);
+			slot(i)->chars = NULL;
+			scm_stats.strings_freed++;
+		}
+		else if (SCM_BLOCK_SIZE(chars->capacity) <= SCM_CLASS_NUM * SCM_CLASS_SIZE) {
+			live += SCM_BLOCK_SIZE(chars->capacity) / chars->refs;
+		}
+	}
+	if (page_bytes <= SCM_PAGE_SIZE || live * 2 > page_bytes) return;
+
+	scm_page_t *old = pages;
+	pages = NULL;
+	bump = bump_end = NULL;
+	memset(free_list, 0, sizeof(free_list));
+	page_bytes = 0;
+	for (uint32_t i = 0; i < string_num; i++) {
+		scm_chars_t *chars = slot(i)->chars;
+		if (chars == NULL) continue;
+		if (chars->refs == 0) { /* moved for another slice */
+			memcpy(&slot(i)->chars, chars->data, sizeof(scm_chars_t *));
+			continue;
+		}
+		size_t size = SCM_BLOCK_SIZE(chars->capacity);
+		if (size > SCM_CLASS_NUM * SCM_CLASS_SIZE) continue;
+		scm_chars_t *moved = block_alloc(size);
+		if (moved == NULL) scm_fatal("out of string memory");
+		memcpy(moved, chars, size);
+		if (moved->refs > 1) {
+			chars->refs = 0;
+			memcpy(chars->data, &moved, sizeof(scm_chars_t *));
+		}
+		slot(i)->chars = moved;
+	}
+	free_pages(old);
+}
+
+extern const char *scm_string_value(scm_obj_t string)
 {
 	if (!scm_is_string(string)) {
 		(void)scm_error("error: scm_string_value: not a string");
@@ -64,26 +289,205 @@ extern char *scm_string_value(scm_obj_t string)
 
 	uint32_t i = (uint32_t)string;
 
-	assert(i < SCM_STRING_NUM);
-	assert(strings[i].string != NULL);
+	assert(i < string_num);
+	assert(slot(i)->chars != NULL);
 
-	return strings[i].string;
+	return slot(i)->chars->data + slot(i)->offset;
 }
 
-extern scm_obj_t scm_string(const char *string, size_t k)
+/* The characters of a string, which gets a block of its own first if it
+ * shares one */
+extern char *scm_string_mutable(scm_obj_t string)
+{
+	assert(scm_is_string(string));
+
+	scm_string_t *s = slot((uint32_t)string);
+	if (s->chars->refs > 1) {
+		scm_chars_t *copy = block_alloc(SCM_BLOCK_SIZE(s->length));
+		if (copy == NULL) scm_fatal("out of string memory");
+		copy->capacity = s->length;
+		copy->refs = 1;
+		memcpy(copy->data, s->chars->data + s->offset, s->length);
+		copy->data[s->length] = 0;
+		block_release(s->chars);
+		s->chars = copy;
+		s->offset = 0;
+	}
+	return s->chars->data + s->offset;
+}
+
+extern size_t scm_string_length(scm_obj_t string)
+{
+	assert(scm_is_string(string));
+	uint32_t i = (uint32_t)string;
+
+	assert(i < string_num);
+	assert(slot(i)->chars != NULL);
+
+	return slot(i)->length;
+}
+
+extern bool scm_string_equal(scm_obj_t a, scm_obj_t b)
+{
+	size_t n = scm_string_length(a);
+	return n == scm_string_length(b) && memcmp(scm_string_value(a), scm_string_value(b), n) == 0;
+}
+
+/* Takes the next free slot, the caller fills it in */
+static uint32_t take_slot(void)
+{
+	/* a word of mark bits at a time, the table grows rather than
+	 * failing when the sweep runs out before a collection */
+	while (sweep_index < string_num) {
+		uint64_t unmarked = ~chunks[sweep_index / SCM_STRING_CHUNK]->mark[sweep_index % SCM_STRING_CHUNK / 64] >> (sweep_index % 64);
+		if (unmarked != 0) {
+			sweep_index += (uint32_t)__builtin_ctzll(unmarked);
+			break;
+		}
+		sweep_index += 64 - sweep_index % 64;
+	}
+	if (sweep_index == string_num && !grow()) scm_fatal("out of string memory");
+
+	uint32_t i = sweep_index++;
+
+	if (slot(i)->chars != NULL) { /* dead since the last collection */
+		block_release(slot(i)->chars);
+		scm_stats.strings_freed++;
+	}
+	scm_stats.strings++;
+	if (scm_gc_marking) { /* allocate black */
+		__atomic_fetch_or(&chunks[i / SCM_STRING_CHUNK]->next[i % SCM_STRING_CHUNK / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+		__atomic_fetch_add(&next_num, 1, __ATOMIC_RELAXED);
+	}
+	used_num++;
+	if (low()) scm_gc_requested = true;
+
+	return i;
+}
+
+/* A string of k characters, the caller fills them in */
+static scm_obj_t alloc(size_t k, char **data)
 {
-	if (head == UINT32_MAX) scm_fatal("out of string memory");
+	if (k >= UINT32_MAX) return scm_error("string too long");
+	scm_chars_t *chars = block_alloc(SCM_BLOCK_SIZE(k));
+	if (chars == NULL) return scm_error("string allocation failed");
+	chars->capacity = (uint32_t)k;
+	chars->refs = 1;
+	chars->data[k] = 0;
+	*data = chars->data;
 
-	char *cstr = strndup(string, k);
-	if (cstr == NULL) return scm_error("string allocation failed");
+	uint32_t i = take_slot();
+	*slot(i) = (scm_string_t){ chars, 0, (uint32_t)k };
+	scm_stats.string_bytes += k + 1;
 
-	uint32_t i = head;
+	return SCM_STRING | i;
+}
+
+/* n characters from start on, sharing the block of a heap string */
+extern scm_obj_t scm_string_slice(scm_obj_t string, size_t start, size_t n)
+{
+	assert(start + n <= scm_string_length(string));
 
-	assert(i < SCM_STRING_NUM);
-	assert(strings[i].string == NULL);
+	scm_string_t *s = slot((uint32_t)string);
+	scm_chars_t *chars = s->chars;
+	uint32_t offset = s->offset + (uint32_t)start;
 
-	strings[i].string = cstr;
-	head = strings[i].next;
+	chars->refs++; /* before the slot could release a dead slice of it */
+	uint32_t i = take_slot();
+	*slot(i) = (scm_string_t){ chars, offset, (uint32_t)n };
 
 	return SCM_STRING | i;
 }
+
+/* An empty string with room for n characters to append */
+extern scm_obj_t scm_string_buffer(size_t n)
+{
+	char *data;
+	scm_obj_t obj = alloc(n, &data);
+	if (!scm_is_error(obj)) slot((uint32_t)obj)->length = 0;
+	return obj;
+}
+
+/* Appends in place while there is room, else moves the characters to a
+ * block of twice the new length, so building a string stays linear */
+extern scm_obj_t scm_string_append_chars(scm_obj_t string, const char *chars, size_t n)
+{
+	assert(scm_is_string(string));
+	scm_string_t *s = slot((uint32_t)string);
+	size_t length = s->length + n;
+
+	if (length >= UINT32_MAX / 2) return scm_error("string too long");
+	if (s->chars->refs == 1 && s->offset + length <= s->chars->capacity) {
+		memcpy(s->chars->data + s->offset + s->length, chars, n);
+		s->length = (uint32_t)length;
+		return scm_unspecified();
+	}
+
+	size_t capacity = (length < 8) ? 16 : 2 * length;
+	scm_chars_t *copy = block_alloc(SCM_BLOCK_SIZE(capacity));
+	if (copy == NULL) return scm_error("string allocation failed");
+	copy->capacity = (uint32_t)capacity;
+	copy->refs = 1;
+	copy->data[capacity] = 0;
+	memcpy(copy->data, s->chars->data + s->offset, s->length);
+	memcpy(copy->data + s->length, chars, n); /* may be from the old block */
+	block_release(s->chars);
+	*s = (scm_string_t){ copy, 0, (uint32_t)length };
+	scm_stats.string_bytes += capacity + 1;
+	return scm_unspecified();
+}
+
+extern scm_obj_t scm_string_append(scm_obj_t args)
+{
+	size_t n = 0;
+	for (scm_obj_t x = args; scm_is_pair(x); x = scm_cdr(x)) {
+		scm_obj_t string = scm_car(x);
+		if (!scm_is_string(string)) return scm_error("string-append: needs strings");
+		n += scm_string_length(string);
+	}
+
+	char *data;
+	scm_obj_t obj = alloc(n, &data);
+	if (scm_is_error(obj)) return obj;
+	for (scm_obj_t x = args; scm_is_pair(x); x = scm_cdr(x)) {
+		scm_obj_t string = scm_car(x);
+		size_t k = scm_string_length(string);
+		memcpy(data, scm_string_value(string), k);
+		data += k;
+	}
+	return obj;
+}
+
+/* Up to k characters, like strndup() */
+extern scm_obj_t scm_string(const char *string, size_t k)
+{
+	return scm_string_copy(string, strnlen(string, k));
+}
+
+/* Exactly n characters, which may include NUL */
+extern scm_obj_t scm_string_copy(const char *string, size_t n)
+{
+	char *data;
+	scm_obj_t obj = alloc(n, &data);
+	if (!scm_is_error(obj)) memcpy(data, string, n);
+	return obj;
+}
+
+extern scm_obj_t scm_make_string(scm_obj_t args)
+{
+	scm_obj_t k = scm_car(args), fill = scm_char(' ');
+	if (!scm_is_number(k)) return scm_error("make-string: needs a number");
+	size_t n = scm_number_to_size(k);
+	if (n == SIZE_MAX) return scm_error("make-string: can't convert to size_t");
+
+	args = scm_cdr(args);
+	if (!scm_is_null(args)) {
+		fill = scm_car(args);
+		if (!scm_is_char(fill) || !scm_is_null(scm_cdr(args))) return scm_error("make-string: bad arguments, should be (make-string k [char])");
+	}
+
+	char *data;
+	scm_obj_t obj = alloc(n, &data);
+	if (!scm_is_error(obj)) memset(data, scm_char_value(fill), n);
+	return obj;
+}
@@ -1630,9 +1630,9 @@
 ;(define (string-downcase s)
 ;  (list->string (map char-downcase (string->list s))))
 
-;(test (make-string 0) "")
-;(test (make-string 1) " ")
-;(test (make-string 3 #\x) "xxx")
+(test (make-string 0) "")
+(test (make-string 1) " ")
+(test (make-string 3 #\x) "xxx")
 
 (test (number->string 0) "0")
 (test (number->string 123) "123")
@@ -2894,6 +2894,160 @@
 
 ; === End of R4RS tests ===
 
+; scm754 runtime statistics
+
+(define (stat key alist)
+  (if (eq? (car (car alist)) key) (cdr (car alist)) (stat key (cdr alist))))
+(test (> (stat 'conses (gc-stats)) 0) #t)
+(test (number? (stat 'pause-max-ns (gc-stats))) #t)
+; evals counts the nodes of the tree-walker, instructions those of --vm
+(test (> (+ (stat 'evals (runtime-stats)) (stat 'instructions (runtime-stats))) (stat 'applies (runtime-stats))) #t)
+(test (> (stat 'stack-peak (runtime-stats)) 0) #t)
+
+; a standard procedure redefined by the user is called in tail position,
+; (max 10000000) ran out of stack on the bytecode machine
+(define saved-max max)
+(define (max n) (if (= n 0) 'done (max (- n 1))))
+(define tail-calls-before (stat 'tail-calls (runtime-stats)))
+(test (max 1000) 'done)
+(test (>= (- (stat 'tail-calls (runtime-stats)) tail-calls-before) 1000) #t)
+(define max saved-max)
+(test (max 1 2) 2)
+
+; more live strings than the initial string table holds
+(define (make-strings n l)
+  (if (= n 0) l (make-strings (- n 1) (cons (make-string (modulo n 7) #\s) l))))
+(define many-strings (make-strings 10000 '()))
+(test (length many-strings) 10000)
+(test (string-length (list-ref many-strings 9999)) 4)
+(test (list-ref many-strings 5002) "sssss")
+
+; number->string returns new, mutable strings
+(test (number->string 123456) "123456")
+(test (string-length (number->string 123456)) 6)
+(test (string-length (number->string 1234567)) 7)
+(test (string=? (number->string 12) "12") #t)
+(test (equal? (cons (number->string 1.5) '()) '("1.5")) #t)
+(test (string-ref (number->string 42) 1) #\2)
+(test (substring (number->string 123456) 2 4) "34")
+(test (let ((s (number->string 7))) (string-set! s 0 #\8) s) "8")
+
+; substring shares the characters until either string is changed
+(define text (make-string 11 #\-))
+(define (fill-text k) (if (< k 11) (fill-text2 k)))
+(define (fill-text2 k) (string-set! text k (string-ref "hello world" k)) (fill-text (+ k 1)))
+(fill-text 0)
+(define hello (substring text 0 5))
+(define world (substring text 6 11))
+(test (substring world 1 4) "orl")
+(test ((lambda () (string-set! world 0 #\W) world)) "World")
+(test ((lambda () (string-set! text 0 #\H) text)) "Hello world")
+(test hello "hello")
+(test (substring text 6 11) "world")
+
+; string ports and string-append
+(test (string-append) "")
+(test (string-append "ab" (number->string 12) "" "cd") "ab12cd")
+(define out (open-output-string))
+(write "a" out)
+(display #t out)
+(newline out)
+(test (string-length (get-output-string out)) 6)
+(test (substring (get-output-string out) 3 5) "#t")
+(define (write-numbers n port) (if (> n 0) (write-numbers2 n port)))
+(define (write-numbers2 n port) (display n port) (write-numbers (- n 1) port))
+(write-numbers 1000 out)
+(test (string-length (get-output-string out)) 2899)
+(test (with-output-to-string (lambda () (display "x") (write 'y) (display '(1 "z")))) "xy(1 z)")
+(test (string-length (with-output-to-string (lambda () (write-numbers 100 (current-output-port))))) 192)
+
+; input ports
+(define in (open-input-string "(1 (2 . x)) foo #t xy"))
+(test (input-port? in) #t)
+(test (output-port? in) #f)
+(test (output-port? out) #t)
+(test (read in) '(1 (2 . x)))
+(test (read in) 'foo)
+(test (read in) #t)
+(test (char? (read-char in)) #t)
+(test (peek-char in) #\x)
+(test (read-char in) #\x)
+(test (read-char in) #\y)
+(test (eof-object? (peek-char in)) #t)
+(test (eof-object? (read in)) #t)
+(define in (open-input-file "test-r7rs.scm"))
+(test (input-port? in) #t)
+(test (pair? (read in)) #t)
+(close-port in)
+
+; buffered output
+(test (flush-output-port out) (void))
+(define out (open-output-file "/tmp/scm754-test-output"))
+(test (output-port? out) #t)
+(write-numbers 3 out)
+(write '("a" #\b -0.5 12345678901) out)
+(close-port out)
+(define in (open-input-file "/tmp/scm754-test-output"))
+(test (read in) 321)
+(test (read in) '("a" #\b -0.5 12345678901))
+(close-port in)
+
+; global variables
+(define (shadow car) (car 1))
+(test (shadow (lambda (x) (+ x 1))) 2)
+(test (car '(1 2)) 1)
+(define twice 1)
+(define twice 2)
+(test twice 2)
+(define (read-twice) twice)
+(define twice 3)
+(test (read-twice) 3)
+
+; lexical addressing
+(define (rest-args a . xs) (cons a xs))
+(test (rest-args 1 2 3) '(1 2 3))
+(test (rest-args 1) '(1))
+(define (no-params) (define local 2) (define (get) local) (get))
+(test (no-params) 2)
+(define local 1)
+(test (no-params) 2)
+(test local 1)
+(define (shadowing x)
+  (let ((y (+ x 1)))
+    (let* ((x (* y 2)) (y (+ x 1)))
+      (cons x y))))
+(test (shadowing 1) '(4 . 5))
+(define (counter n) (lambda () n))
+(test ((counter 7)) 7)
+(define (adder a) (lambda (b) (lambda (c) (+ a b c))))
+(test (((adder 1) 2) 3) 6)
+(define (params-define x) (define x 5) x)
+(test (params-define 1) 5)
+(define (three a b c) (define d (+ a b)) (cons d c))
+(test (three 1 2 3) '(3 . 3))
+(define (four a b c d) (cons (+ a b) (+ c d)))
+(test (four 1 2 3 4) '(3 . 7))
+(define (garbage n acc) (if (< n 1) acc (garbage (- n 1) (cons n acc))))
+(define kept ((adder 10) 20))
+(test (length (garbage 10000 '())) 10000)
+(test (kept 30) 60)
+(test (four (car (garbage 2 '())) 2 (length (garbage 5000 '())) 4) '(3 . 5004))
+(test (or #f '(1 2)) '(1 2))
+(test (or '(1 2) #f) '(1 2))
+(test (and 1 '(a)) '(a))
+(define (one-armed x) (if x 'yes))
+(test (one-armed 1) 'yes)
+(define (run-twice f) (cons (f 1) (f 2)))
+(test (run-twice (lambda (x) (if (< x 2) 'small 'large))) '(small . large))
+(define (shadow-car car) (car 1))
+(test (shadow-car (lambda (x) (+ x 1))) 2)
+(define (deep n) (if (= n 0) 0 (+ 1 (deep (- n 1)))))
+(test (deep 500) 500)
+(define (churn-build n acc) (if (= n 0) acc (churn-build (- n 1) (cons n acc))))
+(define churn-live (churn-build 60000 '()))
+(define (churn k junk) (if (= k 0) (length churn-live) (churn (- k 1) (churn-build 100 '()))))
+(test (churn 20000 '()) 60000)
+
 ;(cond ((zero? Errors)
 ;        (display "Everything fine!"))
 ;      (else
@@ -0,0 +1,533 @@
+/* (c) guenter.ebermann@htl-hl.ac.at */
+#include "scm754.h"
+
+/* Bytecode machine, the second engine behind scm_eval(). An analyzed form
+ * (see eval.c) is compiled to code words, an opcode followed by its
+ * operands, and run with a value stack instead of consed argument lists.
+ *
+ * Each lambda and each top-level form is compiled to a code block, a block
+ * of adjacent cells like an environment frame: the header holds the number
+ * of words, the others two words each. It starts with the frame layout of
+ * the lambda and the stack depth its body needs, then the body; jump
+ * targets are relative to the block. Opcodes, jump targets and counts are
+ * small integers, which the collector takes for numbers, so it traces the
+ * constants in the code like any block, and the code of a lambda lives as
+ * long as a closure or an enclosing code block refers to it.
+ *
+ * A closure is (env . code). A call pushes the return address, the
+ * environment and the code block of the caller. A tail call leaves them to
+ * the callee. The value stack is a root array. */
+
+bool scm_vm;
+scm_obj_t *scm_vm_stack;
+size_t scm_vm_sp;
+
+#define SCM_VM_STACK_MAX (1U << 24)
+/* words of a code block, which must fit into a heap segment */
+#define SCM_VM_CODE_MAX (2 * (SCM_SEGMENT_CELLS - 1))
+
+/* The code being compiled, the block of the innermost lambda from unit on.
+ * It refers to heap objects without being a root, there is no safe point
+ * until the blocks are made. */
+static scm_obj_t *buf;
+static size_t buf_size;
+static size_t buf_capacity;
+static size_t unit;
+static bool too_large;
+
+static size_t stack_capacity;
+
+enum {
+	VM_CONST,       /* obj: push obj */
+	VM_LOCAL,       /* local: push the local variable */
+	VM_GLOBAL,      /* symbol: push the global variable */
+	VM_SET_LOCAL,   /* local: store the top, replace it by unspecified */
+	VM_DEFINE,      /* symbol: same for the global variable */
+	VM_POP,
+	VM_JUMP,        /* pc */
+	VM_JUMP_FALSE,  /* pc: pop, jump if it was false */
+	VM_AND,         /* pc: jump if the top is false, else pop */
+	VM_OR,          /* pc: jump if the top is true, else pop */
+	VM_CLOSURE,     /* code: push a closure of the environment */
+	VM_CALL,        /* argc: the procedure and its arguments are on top */
+	VM_TAIL_CALL,   /* argc */
+	VM_PRIM,        /* symbol argc: the standard procedure, unless redefined */
+	VM_TAIL_PRIM,   /* symbol argc: a tail call if redefined */
+	VM_RETURN
+};
+
+typedef struct {
+	size_t depth; /* of the stack when this code runs */
+	size_t max;
+} scm_vm_fn_t;
+
+static void emit(scm_obj_t word)
+{
+	if (buf_size == buf_capacity) {
+		buf_capacity = buf_capacity ? 2 * buf_capacity : 4096;
+		scm_obj_t *grown = realloc(buf, buf_capacity * sizeof(scm_obj_t));
+		if (grown == NULL) scm_fatal("out of code memory");
+		buf = grown;
+	}
+	buf[buf_size++] = word;
+}
+
+/* The position of the next word in its block, a jump target */
+static size_t here(void)
+{
+	return buf_size - unit;
+}
+
+/* Moves the words from unit on into a new code block */
+static scm_obj_t code_block(void)
+{
+	size_t n = buf_size - unit;
+	buf_size = unit;
+	if (n > SCM_VM_CODE_MAX) {
+		too_large = true;
+		return scm_nil();
+	}
+
+	size_t i = scm_gc_block(1 + (n + 1) / 2);
+	cell[i].car_next = scm_number((double)n);
+	cell[i].cdr = scm_nil();
+	memcpy(&cell[i + 1], &buf[unit], n * sizeof(scm_obj_t));
+	if (n & 1) cell[i + 1 + n/2].cdr = scm_unspecified();
+	return SCM_CODE | i;
+}
+
+static inline const scm_obj_t *words(scm_obj_t code)
+{
+	return &cell[(uint32_t)code + 1].car_next;
+}
+
+static void emit2(scm_obj_t op, scm_obj_t operand)
+{
+	emit(op);
+	emit(operand);
+}
+
+static void push(scm_vm_fn_t *fn)
+{
+	if (++fn->depth > fn->max) fn->max = fn->depth;
+}
+
+static void compile(scm_obj_t expr, bool tail, scm_vm_fn_t *fn);
+
+/* The body goes into a block of its own behind the enclosing one */
+static void compile_lambda(scm_obj_t args, scm_vm_fn_t *fn)
+{
+	size_t outer = unit;
+	unit = buf_size;
+	emit(scm_car(args)); /* layout */
+	emit(0);
+	scm_vm_fn_t body = { 0, 0 };
+	for (scm_obj_t x = scm_cdr(args); scm_is_pair(x); x = scm_cdr(x)) {
+		bool last = !scm_is_pair(scm_cdr(x));
+		compile(scm_car(x), last, &body);
+		if (!last) {
+			emit(VM_POP);
+			body.depth--;
+		}
+	}
+	buf[unit + 1] = body.max;
+	scm_obj_t code = code_block();
+	unit = outer;
+
+	emit2(VM_CLOSURE, code);
+	push(fn);
+}
+
+static void compile_if(scm_obj_t args, bool tail, scm_vm_fn_t *fn)
+{
+	compile(scm_car(args), false, fn);
+	emit(VM_JUMP_FALSE);
+	size_t to_else = buf_size;
+	emit(0);
+	fn->depth--;
+
+	args = scm_cdr(args);
+	compile(scm_car(args), tail, fn);
+	size_t to_end = 0;
+	if (!tail) {
+		emit(VM_JUMP);
+		to_end = buf_size;
+		emit(0);
+	}
+	fn->depth--;
+	buf[to_else] = here();
+	compile(scm_cdr(args), tail, fn);
+	if (!tail) buf[to_end] = here();
+}
+
+/* The tests but the last jump to the end with the value that decides */
+static void compile_tests(scm_obj_t args, bool is_and, bool tail, scm_vm_fn_t *fn)
+{
+	if (scm_is_null(args)) {
+		emit2(VM_CONST, scm_boolean(is_and));
+		push(fn);
+		if (tail) emit(VM_RETURN);
+		return;
+	}
+
+	/* the jumps to patch are chained through their operands */
+	size_t chain = 0;
+	for (; scm_is_pair(scm_cdr(args)); args = scm_cdr(args)) {
+		compile(scm_car(args), false, fn);
+		emit2(is_and ? VM_AND : VM_OR, chain);
+		chain = buf_size - 1;
+		fn->depth--;
+	}
+	compile(scm_car(args), tail, fn);
+
+	bool jumps = chain != 0;
+	while (chain != 0) {
+		size_t next = buf[chain];
+		buf[chain] = here();
+		chain = next;
+	}
+	if (tail && jumps) emit(VM_RETURN);
+}
+
+static void compile_apply(scm_obj_t args, uint32_t argc, bool tail, scm_vm_fn_t *fn)
+{
+	scm_obj_t op = scm_car(args);
+	size_t depth = fn->depth;
+	bool prim = scm_is_symbol(op) && (uint32_t)op >= SCM_OP_PROCEDURE_FIRST && (uint32_t)op <= SCM_OP_PROCEDURE_LAST;
+
+	if (!prim) compile(op, false, fn);
+	for (scm_obj_t x = scm_cdr(args); scm_is_pair(x); x = scm_cdr(x))
+		compile(scm_car(x), false, fn);
+	fn->depth = depth;
+	push(fn);
+
+	if (prim) {
+		/* followed by a return for the standard procedure */
+		emit2(tail ? VM_TAIL_PRIM : VM_PRIM, op);
+		emit(argc);
+		if (tail) emit(VM_RETURN);
+	}
+	else {
+		emit2(tail ? VM_TAIL_CALL : VM_CALL, argc);
+	}
+}
+
+/* In tail position the code returns the value */
+static void compile(scm_obj_t expr, bool tail, scm_vm_fn_t *fn)
+{
+	if (scm_is_local(expr)) {
+		emit2(VM_LOCAL, expr);
+		push(fn);
+	}
+	else if (scm_is_symbol(expr)) {
+		emit2(VM_GLOBAL, expr);
+		push(fn);
+	}
+	else if (!scm_is_pair(expr)) {
+		emit2(VM_CONST, expr);
+		push(fn);
+	}
+	else {
+		scm_obj_t node = scm_car(expr);
+		scm_obj_t args = scm_cdr(expr);
+		switch (scm_node_op(node)) {
+		case SCM_OP_QUOTE:
+			emit2(VM_CONST, args);
+			push(fn);
+			break;
+		case SCM_OP_DEFINE:
+			compile(scm_cdr(args), false, fn);
+			emit2(scm_is_local(scm_car(args)) ? VM_SET_LOCAL : VM_DEFINE, scm_car(args));
+			break;
+		case SCM_OP_LAMBDA:
+			compile_lambda(args, fn);
+			break;
+		case SCM_OP_IF:
+			compile_if(args, tail, fn);
+			return;
+		case SCM_OP_AND:
+		case SCM_OP_OR:
+			compile_tests(args, scm_node_op(node) == SCM_OP_AND, tail, fn);
+			return;
+		default:
+			assert(scm_node_op(node) == SCM_OP_APPLY);
+			compile_apply(args, scm_node_argc(node), tail, fn);
+			return;
+		}
+	}
+	if (tail) emit(VM_RETURN);
+}
+
+/* Room for n more values on the stack above scm_vm_sp */
+static bool reserve(size_t n)
+{
+	if (scm_vm_sp + n <= stack_capacity) return true;
+	size_t size = stack_capacity ? stack_capacity : 4096;
+	while (scm_vm_sp + n > size) size *= 2;
+	if (size > SCM_VM_STACK_MAX) return false;
+	scm_obj_t *stack = realloc(scm_vm_stack, size * sizeof(scm_obj_t));
+	if (stack == NULL) return false;
+	scm_vm_stack = stack;
+	stack_capacity = size;
+	return true;
+}
+
+/* The standard procedures the machine runs without an argument list, else
+ * SCM_VM_SLOW to have scm_apply() do it */
+#define SCM_VM_SLOW SCM_ERROR
+static scm_obj_t primitive(uint32_t id, size_t argc, const scm_obj_t *args)
+{
+	if (argc == 0 || argc > 2) return SCM_VM_SLOW;
+	scm_obj_t a = args[0], b = args[argc - 1];
+	if (argc == 1) {
+		switch (id) {
+		case SCM_OP_CAR: if (scm_is_pair(a)) return scm_car(a); break;
+		case SCM_OP_CDR: if (scm_is_pair(a)) return scm_cdr(a); break;
+		case SCM_OP_IS_NULL: return scm_boolean(scm_is_null(a));
+		case SCM_OP_IS_PAIR: return scm_boolean(scm_is_pair(a));
+		default: break;
+		}
+	}
+	else {
+		if (id == SCM_OP_CONS) return scm_cons(a, b);
+		if (id == SCM_OP_IS_EQ) return scm_boolean(scm_is_eq(a, b));
+		if (!scm_is_number(a) || !scm_is_number(b)) return SCM_VM_SLOW;
+		double x = scm_number_value(a), y = scm_number_value(b);
+		switch (id) {
+		case SCM_OP_ADD: return scm_number(x + y);
+		case SCM_OP_SUB: return scm_number(x - y);
+		case SCM_OP_MUL: return scm_number(x * y);
+		case SCM_OP_NUMBER_LT: return scm_boolean(x < y);
+		case SCM_OP_NUMBER_GT: return scm_boolean(x > y);
+		case SCM_OP_NUMBER_LE: return scm_boolean(x <= y);
+		case SCM_OP_NUMBER_GE: return scm_boolean(x >= y);
+		case SCM_OP_NUMBER_EQ: return scm_boolean(x == y);
+		default: break;
+		}
+	}
+	return SCM_VM_SLOW;
+}
+
+static scm_obj_t run(scm_obj_t fn)
+{
+	static const void *const labels[] = {
+		[VM_CONST] = __extension__ &&vm_const,
+		[VM_LOCAL] = __extension__ &&vm_local,
+		[VM_GLOBAL] = __extension__ &&vm_global,
+		[VM_SET_LOCAL] = __extension__ &&vm_set_local,
+		[VM_DEFINE] = __extension__ &&vm_define,
+		[VM_POP] = __extension__ &&vm_pop,
+		[VM_JUMP] = __extension__ &&vm_jump,
+		[VM_JUMP_FALSE] = __extension__ &&vm_jump_false,
+		[VM_AND] = __extension__ &&vm_and,
+		[VM_OR] = __extension__ &&vm_or,
+		[VM_CLOSURE] = __extension__ &&vm_closure,
+		[VM_CALL] = __extension__ &&vm_call,
+		[VM_TAIL_CALL] = __extension__ &&vm_call,
+		[VM_PRIM] = __extension__ &&vm_prim,
+		[VM_TAIL_PRIM] = __extension__ &&vm_prim,
+		[VM_RETURN] = __extension__ &&vm_return,
+	};
+/* the stack pointer is kept in a register, scm_vm_sp is updated for the
+ * collector and for code which may run the machine again */
+#define SYNC()   (scm_vm_sp = (size_t)(sp - scm_vm_stack))
+#define RELOAD() (sp = scm_vm_stack + scm_vm_sp, code = words(fn))
+#define NEXT()   do { scm_stats.instructions++; __extension__ ({ goto *labels[code[pc]]; }); } while (0)
+
+	size_t base = scm_vm_sp;
+	scm_obj_t env = scm_nil(), x, op;
+	const scm_obj_t *args;
+	size_t argc, pop, next;
+	bool tail;
+
+	const scm_obj_t *code = words(fn);
+	if (!reserve(code[1] + 3)) return scm_error("vm: stack overflow");
+	scm_gc_push2(&env, &fn);
+	scm_obj_t *sp = scm_vm_stack + base;
+	size_t pc = 2;
+	*sp++ = SCM_UNSPECIFIED; /* the return address out of run() */
+	*sp++ = env;
+	*sp++ = fn;
+	NEXT();
+
+vm_const:
+	*sp++ = code[pc + 1];
+	pc += 2;
+	NEXT();
+vm_local:
+	x = scm_env_ref(env, code[pc + 1]);
+	if (scm_is_error(x)) goto out;
+	*sp++ = x;
+	pc += 2;
+	NEXT();
+vm_global:
+	x = scm_env_lookup(code[pc + 1]);
+	if (scm_is_error(x)) goto out;
+	*sp++ = x;
+	pc += 2;
+	NEXT();
+vm_set_local:
+	scm_env_set(env, code[pc + 1], sp[-1]);
+	sp[-1] = scm_unspecified();
+	pc += 2;
+	NEXT();
+vm_define:
+	scm_env_define(code[pc + 1], sp[-1]);
+	sp[-1] = scm_unspecified();
+	pc += 2;
+	NEXT();
+vm_pop:
+	sp--;
+	pc++;
+	NEXT();
+vm_jump:
+	pc = code[pc + 1];
+	NEXT();
+vm_jump_false:
+	pc = scm_boolean_value(*--sp) ? pc + 2 : code[pc + 1];
+	NEXT();
+vm_and:
+	if (!scm_boolean_value(sp[-1])) pc = code[pc + 1];
+	else sp--, pc += 2;
+	NEXT();
+vm_or:
+	if (scm_boolean_value(sp[-1])) pc = code[pc + 1];
+	else sp--, pc += 2;
+	NEXT();
+vm_closure:
+	*sp++ = scm_closure(scm_cons(env, code[pc + 1]));
+	pc += 2;
+	NEXT();
+
+vm_call:
+	tail = code[pc] == VM_TAIL_CALL;
+	argc = code[pc + 1];
+	next = pc + 2;
+	SYNC();
+	scm_gc_collect();
+	code = words(fn); /* the copying collector moves the blocks */
+	op = *(sp - argc - 1);
+	pop = argc + 1;
+	goto apply;
+vm_prim:
+	tail = code[pc] == VM_TAIL_PRIM;
+	argc = code[pc + 2];
+	next = pc + 3;
+	op = scm_globals[(uint32_t)code[pc + 1]];
+	pop = argc;
+	if (op == scm_procedure((uint32_t)code[pc + 1])) {
+		x = primitive((uint32_t)op, argc, sp - argc);
+		if (x != SCM_VM_SLOW) {
+			sp -= argc;
+			*sp++ = x;
+			pc = next;
+			NEXT();
+		}
+	}
+	SYNC();
+	scm_gc_collect();
+	code = words(fn);
+	op = scm_globals[(uint32_t)code[pc + 1]];
+
+apply:
+	args = sp - argc;
+	scm_stats.applies++;
+	if (scm_is_closure(op)) {
+		size_t c = (uint32_t)op;
+		scm_obj_t callee = cell[c].cdr;
+		scm_obj_t layout = words(callee)[0];
+		uint32_t n = scm_frame_params(scm_car(layout));
+		bool rest = scm_frame_rest(scm_car(layout));
+		if (argc < n || (!rest && argc > n)) {
+			x = scm_error("environment: parameter/argument mismatch");
+			goto out;
+		}
+
+		/* young, no safe point until it is filled */
+		scm_obj_t frame = scm_env_frame(cell[c].car_next, layout);
+		size_t f = (uint32_t)frame + 1;
+		for (uint32_t k = 0; k < n; k++) {
+			if (k & 1) cell[f + k/2].cdr = args[k];
+			else cell[f + k/2].car_next = args[k];
+		}
+		if (rest) {
+			x = scm_nil();
+			for (size_t k = argc; k > n; k--) x = scm_cons(args[k - 1], x);
+			if (n & 1) cell[f + n/2].cdr = x;
+			else cell[f + n/2].car_next = x;
+		}
+		sp -= pop;
+
+		SYNC();
+		if (!reserve(words(callee)[1] + 3)) {
+			x = scm_error("vm: stack overflow");
+			goto out;
+		}
+		RELOAD();
+		if (tail) {
+			scm_stats.tail_calls++;
+		}
+		else {
+			*sp++ = next;
+			*sp++ = env;
+			*sp++ = fn;
+		}
+		env = frame;
+		fn = callee;
+		code = words(fn);
+		pc = 2;
+		NEXT();
+	}
+	if (!scm_is_procedure(op)) {
+		x = scm_error("eval: unknown expression type");
+		goto out;
+	}
+	x = scm_nil();
+	for (size_t k = argc; k > 0; k--) x = scm_cons(args[k - 1], x);
+	sp -= pop;
+	*sp++ = x; /* live while the procedure runs */
+	SYNC();
+	x = scm_apply(op, x);
+	RELOAD();
+	if (scm_is_error(x)) goto out;
+	sp[-1] = x;
+	if (!tail) {
+		pc = next;
+		NEXT();
+	}
+
+vm_return:
+	x = *--sp;
+	fn = *--sp;
+	env = *--sp;
+	if (*--sp == SCM_UNSPECIFIED) goto out;
+	pc = *sp;
+	code = words(fn);
+	*sp++ = x;
+	NEXT();
+
+out:
+	scm_vm_sp = base;
+	scm_gc_pop2();
+	return x;
+#undef SYNC
+#undef RELOAD
+#undef NEXT
+}
+
+/* Compiles an analyzed top-level form into a code block and runs it, the
+ * block is garbage afterwards unless a closure refers to code in it */
+extern scm_obj_t scm_vm_execute(scm_obj_t expr)
+{
+	assert(buf_size == 0);
+	unit = 0;
+	too_large = false;
+	emit(scm_unspecified()); /* no frame */
+	emit(0);
+	scm_vm_fn_t fn = { 0, 0 };
+	compile(expr, true, &fn);
+	buf[1] = fn.max;
+	scm_obj_t code = code_block();
+	if (too_large) return scm_error("vm: form too large");
+	return run(code);
+}
@@ -1,91 +1,144 @@
 /* (c) guenter.ebermann@htl-hl.ac.at */
 #include "scm754.h"
 
-static void print_list(scm_obj_t obj)
+static void put(scm_obj_t port, const char *s)
+{
+	(void)scm_port_write(port, s, strlen(s));
+}
+
+static void put_char(scm_obj_t port, char c)
+{
+	(void)scm_port_write(port, &c, 1);
+}
+
+static void print(scm_obj_t port, scm_obj_t obj, bool readable);
+
+static void print_list(scm_obj_t port, scm_obj_t obj, bool readable)
 {
 	size_t len;
+	char buf[48];
 
 	if ((len = scm_length(obj)) > 100) {
-		printf("(<toolong %lu>)", len);
+		snprintf(buf, sizeof buf, "(<toolong %lu>)", len);
+		put(port, buf);
 		return;
 	}
-	putchar('(');
+	put_char(port, '(');
 	while (1) {
-		scm_write(scm_car(obj));
+		print(port, scm_car(obj), readable);
 		obj = scm_cdr(obj);
 		if (!scm_is_pair(obj)) break;
-		putchar(' ');
+		put_char(port, ' ');
 	}
 	if (!scm_is_null(obj)) {
-		fputs(" . ", stdout);
-		scm_write(obj);
+		put(port, " . ");
+		print(port, obj, readable);
 	}
-	putchar(')');
+	put_char(port, ')');
 }
 
-extern void print(scm_obj_t obj, bool readable)
+static void print(scm_obj_t port, scm_obj_t obj, bool readable)
 {
+	char buf[32];
+
 	if (scm_is_null(obj)) {
-		fputs("()", stdout);
+		put(port, "()");
 	}
 	else if (scm_is_boolean(obj)) {
-		fputs(scm_boolean_value(obj) ? "#t" : "#f", stdout);
+		put(port, scm_boolean_value(obj) ? "#t" : "#f");
 	}
 	else if (scm_is_eof_object(obj)) {
-		fputs("#!eof", stdout);
+		put(port, "#!eof");
 	}
 	else if (scm_is_dot(obj)) {
-		fputs("#!dot", stdout);
+		put(port, "#!dot");
 	}
 	else if (scm_is_rparen(obj)) {
-		fputs("#!rparen", stdout);
+		put(port, "#!rparen");
 	}
 	else if (scm_is_unspecified(obj)) {
-		fputs("#!unspecified", stdout);
+		put(port, "#!unspecified");
 	}
 	else if (scm_is_error(obj)) {
-		fputs("#!error", stdout);
+		put(port, "#!error");
 	}
 	else if (scm_is_procedure(obj)) {
-		printf("#!%s", scm_procedure_string(obj));
+		put(port, "#!");
+		put(port, scm_procedure_string(obj));
 	}
 	else if (scm_is_closure(obj)) {
-		fputs("#!closure", stdout);
+		put(port, "#!closure");
+	}
+	else if (scm_is_port(obj)) {
+		put(port, "#!port");
+	}
+	else if (scm_is_env(obj)) {
+		put(port, "#!frame");
 	}
 	else if (scm_is_symbol(obj)) {
-		fputs(scm_string_value(scm_symbol_to_string(obj)), stdout);
+		(void)scm_port_write(port, scm_symbol_name(obj), scm_symbol_length(obj));
 	}
 	else if (scm_is_string(obj)) {
-		if (readable) putchar('\"');
-		fputs(scm_string_value(obj), stdout);
-		if (readable) putchar('\"');
+		if (readable) put_char(port, '\"');
+		(void)scm_port_write(port, scm_string_value(obj), scm_string_length(obj));
+		if (readable) put_char(port, '\"');
 	}
 	else if (scm_is_pair(obj)) {
-		print_list(obj);
+		print_list(port, obj, readable);
 	}
 	else if (scm_is_char(obj)) {
-		fputs("#\\", stdout);
-		putchar(scm_char_value(obj));
+		buf[0] = '#';
+		buf[1] = '\\';
+		buf[2] = (char)scm_char_value(obj);
+		(void)scm_port_write(port, buf, 3);
 	}
 	else {
-		printf("%.16g", scm_number_value(obj));
+		(void)scm_port_write(port, buf, scm_number_format(scm_number_value(obj), buf));
 	}
 }
 
+/* The optional port argument of write, display and newline */
+static scm_obj_t port_arg(scm_obj_t args, const char *name)
+{
+	if (scm_is_null(args)) return scm_current_output_port;
+	scm_obj_t port = scm_car(args);
+	if (!scm_is_output_port(port) || !scm_is_null(scm_cdr(args))) return scm_error("%s: bad port argument", name);
+	return port;
+}
+
+/* (write obj [port]) or (display obj [port]) */
+extern scm_obj_t scm_write_port(scm_obj_t args, bool readable)
+{
+	if (!scm_is_pair(args)) return scm_error("%s: needs an object", readable ? "write" : "display");
+	scm_obj_t port = port_arg(scm_cdr(args), readable ? "write" : "display");
+	if (scm_is_error(port)) return port;
+	print(port, scm_car(args), readable);
+	return scm_unspecified();
+}
+
+/* (newline [port]) */
+extern scm_obj_t scm_newline_port(scm_obj_t args)
+{
+	scm_obj_t port = port_arg(args, "newline");
+	if (scm_is_error(port)) return port;
+	put_char(port, '\n');
+	return scm_unspecified();
+}
+
 extern scm_obj_t scm_write(scm_obj_t obj)
 {
-	print(obj, true);
+	print(scm_current_output_port, obj, true);
 	return scm_unspecified();
 }
 
 extern scm_obj_t scm_display(scm_obj_t obj)
 {
-	print(obj, false);
+	print(scm_current_output_port, obj, false);
 	return scm_unspecified();
 }
 
 extern scm_obj_t scm_newline(void)
 {
-	putchar('\n');
+	put_char(scm_current_output_port, '\n');
 	return scm_unspecified();
 }